@@ -26,6 +26,9 @@ layout(std140) uniform voxel_data
     // The number of leaf nodes visited in a PCF kernel
     uniform uint _PCFLookups;
     
+    // Each segment of the tree holds 2^_VoxelSegmentBits words
+    uniform uint _VoxelSegmentBits;
+    
     // The bitmask and offset for PCF kernel lookups.
     // Stores (xOffset, yOffset, bitmask0, bitmask1)
     // PCF_MAX_LOOKUPS values per original leaf mask index
@@ -35,8 +38,16 @@ layout(std140) uniform voxel_data
 // Scene depth texture
 uniform sampler2D _MainTexture;
 
-// Voxelized Shadow Map data
-uniform usamplerBuffer _VoxelData;
+// Voxelized Shadow Map data, split into segments.
+// Must match VoxelsUniformBuffer::MaxTreeSegments.
+uniform usamplerBuffer _VoxelData0;
+uniform usamplerBuffer _VoxelData1;
+uniform usamplerBuffer _VoxelData2;
+uniform usamplerBuffer _VoxelData3;
+uniform usamplerBuffer _VoxelData4;
+uniform usamplerBuffer _VoxelData5;
+uniform usamplerBuffer _VoxelData6;
+uniform usamplerBuffer _VoxelData7;
 
 in vec2 texcoord;
 
@@ -68,11 +79,36 @@ uvec3 getVoxelCoord(vec4 worldSpacePosition)
     return uvec3((_WorldToVoxel * worldSpacePosition).xyz);
 }
 
+/*
+ * Reads a word of the voxel tree.
+ * The upper address bits choose the segment. Samplers can only be picked
+ * from an array by values that are the same for every pixel, so each
+ * segment is checked in turn.
+ */
+uint fetchVoxelWord(uint address)
+{
+    uint segment = address >> _VoxelSegmentBits;
+    int index = int(address & ((1u << _VoxelSegmentBits) - 1u));
+    
+    switch(segment)
+    {
+        case 0u: return texelFetch(_VoxelData0, index).r;
+        case 1u: return texelFetch(_VoxelData1, index).r;
+        case 2u: return texelFetch(_VoxelData2, index).r;
+        case 3u: return texelFetch(_VoxelData3, index).r;
+        case 4u: return texelFetch(_VoxelData4, index).r;
+        case 5u: return texelFetch(_VoxelData5, index).r;
+        case 6u: return texelFetch(_VoxelData6, index).r;
+        default: return texelFetch(_VoxelData7, index).r;
+    }
+}
+
 /*
  * Computes the child index at a given depth for the specified coord.
  * Must be consistent with the cpp builder code.
+ * The coord is mirrored to match the stored node.
  */
-uint getChildIndex(uint depth, uvec3 coord)
+uint getChildIndex(uint depth, uvec3 coord, uint mirror)
 {
     // The last inner node before the leaf nodes is treated differently.
     if(depth == _VoxelTreeHeight - 3u)
@@ -82,9 +118,10 @@ uint getChildIndex(uint depth, uvec3 coord)
         return coord.z & 7u;
     }
     
-    // Get the 0/1 index for each axis
-    uint childIndexX = (coord.x >> (_VoxelTreeHeight - 1u - depth)) & 1u;
-    uint childIndexY = (coord.y >> (_VoxelTreeHeight - 1u - depth)) & 1u;
+    // Get the 0/1 index for each axis.
+    // Mirror bit 0 flips x and bit 1 flips y.
+    uint childIndexX = ((coord.x >> (_VoxelTreeHeight - 1u - depth)) & 1u) ^ (mirror & 1u);
+    uint childIndexY = ((coord.y >> (_VoxelTreeHeight - 1u - depth)) & 1u) ^ (mirror >> 1u);
     uint childIndexZ = (coord.z >> (_VoxelTreeHeight - 1u - depth)) & 1u;
     
     // Combine them
@@ -93,20 +130,13 @@ uint getChildIndex(uint depth, uvec3 coord)
 
 /*
  * Computes the child pointer index for a given child and child mask.
+ * The high bit of a child's state is set when it is expanded, so the
+ * pointer index is the number of high bits set below the child.
  */
 int getChildPointerIndex(uint childMask, uint childIndex)
 {
-    int ptr = 0;
-    
-    for(uint i = 0u; i < childIndex; ++i)
-    {
-        if(((childMask >> (i * 2u)) & 3u) > 1u)
-        {
-            ptr ++;
-        }
-    }
-    
-    return ptr;
+    uint expandedBefore = childMask & 0xAAAAu & ((1u << (childIndex * 2u)) - 1u);
+    return bitCount(expandedBefore);
 }
 
 /*
@@ -122,6 +152,38 @@ uint getVoxelLeafIndex(uvec3 coord)
     return (xIndex << 3) | yIndex;
 }
 
+/*
+ * Reverses the bytes of a word.
+ */
+uint reverseBytes(uint word)
+{
+    return (word >> 24u) | ((word >> 8u) & 0xFF00u) | ((word << 8u) & 0xFF0000u) | (word << 24u);
+}
+
+/*
+ * Mirrors a stored leaf to get the leaf in the tree.
+ * Each byte of the leaf is a row of y voxels.
+ */
+LeafNodeQuery mirrorLeafNode(LeafNodeQuery q, uint mirror)
+{
+    // Reverse the order of the rows
+    if((mirror & 1u) != 0u)
+    {
+        uint highBits = reverseBytes(q.lowBits);
+        q.lowBits = reverseBytes(q.highBits);
+        q.highBits = highBits;
+    }
+    
+    // Reverse the bits in each row
+    if((mirror & 2u) != 0u)
+    {
+        q.highBits = reverseBytes(bitfieldReverse(q.highBits));
+        q.lowBits = reverseBytes(bitfieldReverse(q.lowBits));
+    }
+    
+    return q;
+}
+
 LeafNodeQuery getLeafNode(uvec3 coord)
 {
     // Compute which tile the coord is in
@@ -130,14 +192,19 @@ LeafNodeQuery getLeafNode(uvec3 coord)
     uint tileIndex = (tileX * _TileSubdivisions) + tileY;
     
     // Get the memory address of the first node to visit
-    int memAddress = int(texelFetch(_VoxelData, int(tileIndex)).r);
+    uint memAddress = fetchVoxelWord(tileIndex);
+    
+    // The mirror that gives back the current node from the stored node.
+    // The root nodes are not mirrored.
+    uint mirror = 0u;
 
     // Traverse inner nodes
     for(uint depth = 0u; depth <= _VoxelTreeHeight - 3u; ++depth)
     {
-        // Fetch the node's child mask
-        uint childIndex = getChildIndex(depth, coord);
-        uint childMask = texelFetch(_VoxelData, memAddress).r >> 16;
+        // Fetch the node's child mask and child mirrors
+        uint childIndex = getChildIndex(depth, coord, mirror);
+        uint node = fetchVoxelWord(memAddress);
+        uint childMask = node >> 16;
         uint childState = (childMask >> (childIndex * 2u)) & 3u;
         
         // If uniform shadow, exit early
@@ -152,17 +219,29 @@ LeafNodeQuery getLeafNode(uvec3 coord)
         
         // Mixed shadow
         // Retrieve the child node memory location
-        int childPtrIndex = getChildPointerIndex(childMask, childIndex);
-        int childPtr = memAddress + 1 + childPtrIndex;
-        memAddress = int(texelFetch(_VoxelData, childPtr).r);
+        uint childPtrIndex = uint(getChildPointerIndex(childMask, childIndex));
+        if(childState == 3u)
+        {
+            // The pointers are 16 bit offsets back from the node, two per word
+            uint offsets = fetchVoxelWord(memAddress + 1u + (childPtrIndex >> 1));
+            memAddress -= (offsets >> ((childPtrIndex & 1u) * 16u)) & 65535u;
+        }
+        else
+        {
+            uint childPtr = memAddress + 1u + childPtrIndex;
+            memAddress = fetchVoxelWord(childPtr);
+        }
+        
+        // The child is stored mirrored
+        mirror ^= (node >> (childIndex * 2u)) & 3u;
     }
     
     // We have reached a leaf node.
     LeafNodeQuery q;
     q.treeDepthReached = _VoxelTreeHeight;
-    q.highBits = texelFetch(_VoxelData, memAddress).r;
-    q.lowBits = texelFetch(_VoxelData, memAddress + 1).r;
-    return q;
+    q.highBits = fetchVoxelWord(memAddress);
+    q.lowBits = fetchVoxelWord(memAddress + 1u);
+    return mirrorLeafNode(q, mirror);
 }
 
 /*
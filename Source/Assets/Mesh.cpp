@@ -4,11 +4,21 @@
 #include <fstream>
 #include <cstdio>
 
-Mesh::Mesh(vector<Vector3> positions, vector<Vector3> normals, vector<Vector4> tangents, vector<Vector2> texcoords, vector<MeshElementIndex> elements)
+Mesh::Mesh(vector<Vector3> positions, vector<Vector3> normals, vector<Vector4> tangents, vector<Vector2> texcoords, vector<MeshElementIndex> elements, bool createBuffers)
     : positions_(positions),
+    elements_(elements),
     verticesCount_((int)positions.size()),
-    elementsCount_((int)elements.size())
+    elementsCount_((int)elements.size()),
+    hasBuffers_(createBuffers),
+    vertexArray_(0),
+    elementsBuffer_(0)
 {
+    // Headless meshes keep their data on the CPU only
+    if(!hasBuffers_)
+    {
+        return;
+    }
+    
     // Create vertex array
     glGenVertexArrays(1, &vertexArray_);
     glBindVertexArray(vertexArray_);
@@ -48,6 +58,11 @@ Mesh::Mesh(vector<Vector3> positions, vector<Vector3> normals, vector<Vector4> t
 
 Mesh::~Mesh()
 {
+    if(!hasBuffers_)
+    {
+        return;
+    }
+    
     glDeleteVertexArrays(1, &vertexArray_);
     glDeleteBuffers(4, vertexBuffers_);
     glDeleteBuffers(1, &elementsBuffer_);
@@ -95,7 +110,7 @@ Mesh* Mesh::fullScreenQuad()
     return new Mesh(positions, normals, tangents, texcoords, elements);
 }
 
-Mesh* Mesh::load(const char* fileName)
+Mesh* Mesh::load(const char* fileName, bool createBuffers)
 {
     vector<Vector3> positions;
     vector<Vector3> normals;
@@ -157,5 +172,5 @@ Mesh* Mesh::load(const char* fileName)
         return NULL;
     }
     
-    return new Mesh(positions, normals, tangents, texcoords, elements);
+    return new Mesh(positions, normals, tangents, texcoords, elements, createBuffers);
 }
@@ -19,12 +19,15 @@ typedef unsigned short MeshElementIndex;
 class Mesh
 {
 public:
-    Mesh(vector<Vector3> positions, vector<Vector3> normals, vector<Vector4> tangents, vector<Vector2> texcoords, vector<MeshElementIndex> elements);
+    Mesh(vector<Vector3> positions, vector<Vector3> normals, vector<Vector4> tangents, vector<Vector2> texcoords, vector<MeshElementIndex> elements, bool createBuffers = true);
     ~Mesh();
     
     // Object space vertex positions
     const Vector3* vertices() const { return &positions_[0]; }
     
+    // Triangle vertex indices, 3 per triangle
+    const MeshElementIndex* elements() const { return &elements_[0]; }
+    
     // Vertex and elements info
     int verticesCount() const { return verticesCount_; }
     int elementsCount() const { return elementsCount_; }
@@ -37,13 +40,17 @@ public:
     // Creates a fullscreen quad
     static Mesh* fullScreenQuad();
     
-    // Loads a mesh from a file
-    static Mesh* load(const char* fileName);
+    // Loads a mesh from a file.
+    // Without createBuffers, only the positions and elements are kept
+    // on the CPU and no OpenGL context is needed.
+    static Mesh* load(const char* fileName, bool createBuffers = true);
     
 private:
     vector<Vector3> positions_;
+    vector<MeshElementIndex> elements_;
     int verticesCount_;
     int elementsCount_;
+    bool hasBuffers_;
     GLuint vertexArray_;
     GLuint vertexBuffers_[4];
     GLuint elementsBuffer_;
@@ -49,7 +49,11 @@ Shader::Shader(const string &name, ShaderFeatureList features)
     normalMapTextureLoc_ = glGetUniformLocation(program_, "_NormalMap");
     shadowMapTextureLoc_ = glGetUniformLocation(program_, "_ShadowMapTexture");
     shadowMaskTextureLoc_ = glGetUniformLocation(program_, "_ShadowMask");
-    voxelDataTextureLoc_ = glGetUniformLocation(program_, "_VoxelData");
+    for(int i = 0; i < VoxelsUniformBuffer::MaxTreeSegments; ++i)
+    {
+        string name = "_VoxelData" + std::to_string(i);
+        voxelDataTextureLocs_[i] = glGetUniformLocation(program_, name.c_str());
+    }
 }
 
 Shader::~Shader()
@@ -73,7 +77,12 @@ void Shader::bind()
     glUniform1i(normalMapTextureLoc_, 1);
     glUniform1i(shadowMapTextureLoc_, 2);
     glUniform1i(shadowMaskTextureLoc_, 3);
-    glUniform1i(voxelDataTextureLoc_, 4);
+    
+    // The voxel tree segments use the units from 4 up
+    for(int i = 0; i < VoxelsUniformBuffer::MaxTreeSegments; ++i)
+    {
+        glUniform1i(voxelDataTextureLocs_[i], 4 + i);
+    }
 }
 
 bool Shader::compileShader(GLenum type, const char* fileName, GLuint &id)
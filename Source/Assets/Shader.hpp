@@ -6,6 +6,8 @@
 #include <string>
 #include <vector>
 
+#include "UniformManager.hpp"
+
 using namespace std;
 
 
@@ -74,7 +76,7 @@ private:
     GLint normalMapTextureLoc_;
     GLint shadowMapTextureLoc_;
     GLint shadowMaskTextureLoc_;
-    GLint voxelDataTextureLoc_;
+    GLint voxelDataTextureLocs_[VoxelsUniformBuffer::MaxTreeSegments];
     
     // Shader compilation
     bool compileShader(GLenum type, const char* file, GLuint &id);
@@ -0,0 +1,50 @@
+#include "CommandLine.hpp"
+
+bool flagSet(std::string flag, int argc, char* argv[])
+{
+    for(int i = 0; i < argc; ++i)
+    {
+        // Check if the flag exists
+        std::string actualValue(argv[i]);
+        if(actualValue == flag)
+        {
+            return true;
+        }
+    }
+    
+    // No flag set.
+    return false;
+}
+
+std::string flagValue(std::string flag, std::string defaultValue, int argc, char* argv[])
+{
+    // The value is the argument after the flag
+    for(int i = 0; i < argc - 1; ++i)
+    {
+        std::string actualValue(argv[i]);
+        if(actualValue == flag)
+        {
+            return std::string(argv[i + 1]);
+        }
+    }
+    
+    // No flag set.
+    return defaultValue;
+}
+
+int getTreeResolution(int argc, char* argv[])
+{
+    // Look for a resolution flag
+    if(flagSet("2k", argc, argv)) return 2048;
+    if(flagSet("4k", argc, argv)) return 4096;
+    if(flagSet("8k", argc, argv)) return 8192;
+    if(flagSet("16k", argc, argv)) return 16384;
+    if(flagSet("32k", argc, argv)) return 32768;
+    if(flagSet("64k", argc, argv)) return 65536;
+    if(flagSet("128k", argc, argv)) return 131072;
+    if(flagSet("256k", argc, argv)) return 262144;
+    if(flagSet("512k", argc, argv)) return 524288;
+    
+    // No flag set, use 32K as the default
+    return 32768;
+}
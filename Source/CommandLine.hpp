@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+// Returns true if the flag is one of the command line arguments
+bool flagSet(std::string flag, int argc, char* argv[]);
+
+// Returns the argument following the flag, or defaultValue if
+// the flag is not set.
+std::string flagValue(std::string flag, std::string defaultValue, int argc, char* argv[]);
+
+// Gets the voxel tree resolution from a resolution flag (eg 64k).
+// Defaults to 32K.
+int getTreeResolution(int argc, char* argv[]);
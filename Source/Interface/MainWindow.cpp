@@ -3,10 +3,10 @@
 #include <QVariant>
 #include <QScrollArea>
 
-MainWindow::MainWindow(bool fullScreen, const QGLFormat &format, int voxelResolution)
+MainWindow::MainWindow(bool fullScreen, const QGLFormat &format, int voxelResolution, const string &voxelTreeFile)
 {
     // Create main renderer
-    rendererWidget_ = new RendererWidget(format, voxelResolution);
+    rendererWidget_ = new RendererWidget(format, voxelResolution, voxelTreeFile);
     
     // Create groups
     statsGroupBox_ = new QGroupBox("Stats");
@@ -12,7 +12,7 @@
 class MainWindow : public QWidget
 {
 public:
-    MainWindow(bool fullScreen, const QGLFormat &format, int voxelResolution);
+    MainWindow(bool fullScreen, const QGLFormat &format, int voxelResolution, const string &voxelTreeFile);
 
     // Renderer and side panel
     RendererWidget* rendererWidget() const { return rendererWidget_; }
@@ -5,11 +5,12 @@
 
 #include <iostream>
 
-RendererWidget::RendererWidget(const QGLFormat &format, int voxelResolution)
+RendererWidget::RendererWidget(const QGLFormat &format, int voxelResolution, const string &voxelTreeFile)
     : QGLWidget(format),
     overlays_(),
     currentOverlay_(-1),
-    voxelResolution_(voxelResolution)
+    voxelResolution_(voxelResolution),
+    voxelTreeFile_(voxelTreeFile)
 {
     sceneDepthTexture_ = NULL;
 }
@@ -104,8 +105,18 @@ void RendererWidget::initializeGL()
     shadowMap_ = new ShadowMap(scene_, uniformManager_, 2, 4096);
     shadowMask_ = new ShadowMask(uniformManager_, SMM_Combined);
     
-    // Create and build the voxel tree
-    voxelTree_ = new VoxelTree(uniformManager_, scene_, voxelResolution_);
+    // Load a prebuilt voxel tree if one was given
+    voxelTree_ = NULL;
+    if(!voxelTreeFile_.empty())
+    {
+        voxelTree_ = VoxelTree::loadFromFile(uniformManager_, scene_, voxelTreeFile_);
+    }
+    
+    // Otherwise create and build the voxel tree
+    if(voxelTree_ == NULL)
+    {
+        voxelTree_ = new VoxelTree(uniformManager_, scene_, voxelResolution_);
+    }
     shadowMask_->setVoxelTree(voxelTree_);
     
     // Create RenderPass instances
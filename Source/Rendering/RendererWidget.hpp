@@ -15,7 +15,9 @@
 class RendererWidget : public QGLWidget
 {
 public:
-    RendererWidget(const QGLFormat &format, int voxelResolution);
+    // The voxel tree is loaded from voxelTreeFile if one is given.
+    // Otherwise a tree with voxelResolution is built.
+    RendererWidget(const QGLFormat &format, int voxelResolution, const string &voxelTreeFile);
     ~RendererWidget();
     
     Scene* scene() { return scene_; }
@@ -73,6 +75,7 @@ private:
     int currentOverlay_;
     
     int voxelResolution_;
+    string voxelTreeFile_;
 
     // QGLWidget override methods
     void initializeGL();
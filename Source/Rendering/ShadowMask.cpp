@@ -111,9 +111,12 @@ void ShadowMask::render()
     // using the shadow map only.
     if(method_ != SMM_ShadowMap)
     {
-        // Bind the input shadow tree
-        glActiveTexture(GL_TEXTURE4);
-        glBindTexture(GL_TEXTURE_BUFFER, voxelTree_->treeBufferTexture());
+        // Bind the input shadow tree segments
+        for(int i = 0; i < VoxelsUniformBuffer::MaxTreeSegments; ++i)
+        {
+            glActiveTexture(GL_TEXTURE4 + i);
+            glBindTexture(GL_TEXTURE_BUFFER, voxelTree_->treeBufferTexture(i));
+        }
         
         // Render using the voxel tree pass
         voxelTreePass_->renderFullScreen();
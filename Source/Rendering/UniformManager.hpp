@@ -54,6 +54,10 @@ struct VoxelsUniformBuffer
 {
     static const int BlockID = 3;
     
+    // The most buffer textures the tree is split between.
+    // Must match the voxel sampling shader.
+    static const int MaxTreeSegments = 8;
+    
     Matrix4x4 worldToVoxels;
     
     uint32_t voxelTreeHeight;
@@ -65,6 +69,11 @@ struct VoxelsUniformBuffer
     // The number of leaf nodes visited for each PCF kernel.
     uint32_t pcfLookups;
     
+    // Each buffer texture holds 2^segmentBits words of the tree.
+    // Padded to keep the PCF offsets aligned as in std140.
+    uint32_t segmentBits;
+    uint32_t padding[3];
+    
     struct PCFOffset
     {
         uint32_t xOffset;
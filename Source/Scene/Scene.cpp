@@ -5,8 +5,9 @@
 
 #include "Platform.hpp"
 
-Scene::Scene()
-    : cameras_(),
+Scene::Scene(bool headless)
+    : headless_(headless),
+    cameras_(),
     lights_(),
     meshInstances_(),
     meshes_(),
@@ -152,8 +153,8 @@ bool Scene::loadMeshInstance(ifstream &file)
     Texture* texture = getTexture(textureName);
     Texture* normalMap = getTexture(normalMapName);
     
-    // Check for errors
-    if(mesh == NULL || texture == NULL)
+    // Check for errors. Headless scenes do not load textures.
+    if(mesh == NULL || (texture == NULL && !headless_))
     {
         printf("Error loading mesh %s or texture %s \n", meshName.c_str(), textureName.c_str());
         return false;
@@ -196,13 +197,19 @@ Mesh* Scene::getMesh(const string &name)
     
     // Load the mesh.
     string fullPath = MESHES_DIRECTORY + name;
-    Mesh* mesh = Mesh::load(fullPath.c_str());
+    Mesh* mesh = Mesh::load(fullPath.c_str(), !headless_);
     meshes_.insert(pair<string, Mesh*>(name, mesh));
     return mesh;
 }
 
 Texture* Scene::getTexture(const string &name)
 {
+    // Textures are not needed without rendering
+    if(headless_)
+    {
+        return NULL;
+    }
+    
     // Use a cached texture if possible.
     auto existing = textures_.find(name);
     if(existing != textures_.end())
@@ -17,7 +17,9 @@ using namespace std;
 class Scene
 {
 public:
-    Scene();
+    // Headless scenes load mesh geometry only, without any
+    // OpenGL resources or textures.
+    Scene(bool headless = false);
     ~Scene();
     
     // The viewers camera
@@ -37,6 +39,9 @@ public:
     
 private:
     
+    // True if no OpenGL resources are created
+    bool headless_;
+    
     // Scene objects
     vector<Camera> cameras_;
     vector<Light> lights_;
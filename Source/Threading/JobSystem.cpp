@@ -0,0 +1,240 @@
+#include "JobSystem.hpp"
+
+#include <assert.h>
+#include <algorithm>
+
+#if defined(__APPLE__)
+    #include <pthread.h>
+#else
+    #include <sys/resource.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+// The worker count used when the shared job system is created
+static int sharedWorkerCount = 0;
+
+// The job system and worker index of the current thread
+static thread_local const JobSystem* currentJobSystem = NULL;
+static thread_local int currentWorker = -1;
+
+JobSystem::JobSystem(int workerCount)
+    : workers_(),
+    queuedJobs_(0),
+    nextWorker_(0),
+    stopping_(false)
+{
+    assert(workerCount > 0);
+
+    // Create the queues before starting any workers, as workers steal from each other
+    for(int i = 0; i < workerCount; ++i)
+    {
+        workers_.push_back(new Worker());
+    }
+
+    for(int i = 0; i < workerCount; ++i)
+    {
+        workers_[i]->workerThread = thread(&JobSystem::workerLoop, this, i);
+    }
+}
+
+JobSystem::~JobSystem()
+{
+    // Wake every worker so they can exit
+    sleepMutex_.lock();
+    stopping_ = true;
+    sleepMutex_.unlock();
+    wakeCondition_.notify_all();
+
+    for(unsigned int i = 0; i < workers_.size(); ++i)
+    {
+        workers_[i]->workerThread.join();
+        delete workers_[i];
+    }
+}
+
+JobSystem* JobSystem::shared()
+{
+    static JobSystem jobSystem(sharedWorkerCount > 0 ? sharedWorkerCount : defaultWorkerCount());
+    return &jobSystem;
+}
+
+void JobSystem::setSharedWorkerCount(int workerCount)
+{
+    assert(workerCount > 0);
+
+    sharedWorkerCount = workerCount;
+}
+
+int JobSystem::defaultWorkerCount()
+{
+    return std::max(1, (int)thread::hardware_concurrency());
+}
+
+void JobSystem::submit(const function<void()> &task, JobCounter* counter)
+{
+    Job job;
+    job.run = task;
+    job.counter = counter;
+
+    if(counter != NULL)
+    {
+        counter->count_ ++;
+    }
+
+    // Workers add jobs to their own queue. Other threads spread
+    // their jobs between the workers.
+    int workerIndex = currentWorkerIndex();
+    if(workerIndex < 0)
+    {
+        workerIndex = nextWorker_++ % workers_.size();
+    }
+
+    Worker* worker = workers_[workerIndex];
+    worker->jobsMutex.lock();
+    worker->jobs.push_back(job);
+    worker->jobsMutex.unlock();
+
+    // Wake a sleeping worker. The lock makes sure a worker
+    // about to sleep sees the new job first.
+    sleepMutex_.lock();
+    queuedJobs_ ++;
+    sleepMutex_.unlock();
+    wakeCondition_.notify_one();
+}
+
+void JobSystem::wait(JobCounter* counter)
+{
+    int workerIndex = currentWorkerIndex();
+
+    while(!counter->done())
+    {
+        // Help with the queued jobs rather than blocking
+        Job job;
+        if(takeJob(workerIndex, job))
+        {
+            runJob(job);
+        }
+        else
+        {
+            // The remaining jobs are running on other threads
+            this_thread::yield();
+        }
+    }
+}
+
+void JobSystem::parallelFor(int count, int rangeCount, const function<void(int first, int last)> &rangeTask)
+{
+    // Use at least 1 range and no more ranges than items
+    rangeCount = std::max(1, std::min(rangeCount, count));
+    int rangeSize = (count + rangeCount - 1) / rangeCount;
+
+    // Queue each range except the last
+    JobCounter counter;
+    for(int first = 0; first + rangeSize < count; first += rangeSize)
+    {
+        int last = first + rangeSize;
+        submit([&rangeTask, first, last]() { rangeTask(first, last); }, &counter);
+    }
+
+    // The calling thread processes the last range
+    int lastFirst = std::max(0, ((count - 1) / rangeSize) * rangeSize);
+    if(count > 0)
+    {
+        rangeTask(lastFirst, count);
+    }
+
+    wait(&counter);
+}
+
+void JobSystem::workerLoop(int workerIndex)
+{
+    currentJobSystem = this;
+    currentWorker = workerIndex;
+
+    lowerThreadPriority();
+
+    while(true)
+    {
+        Job job;
+        if(takeJob(workerIndex, job))
+        {
+            runJob(job);
+            continue;
+        }
+
+        // Sleep until there are more jobs
+        unique_lock<mutex> lock(sleepMutex_);
+        wakeCondition_.wait(lock, [this]() { return queuedJobs_ > 0 || stopping_; });
+
+        if(stopping_)
+        {
+            return;
+        }
+    }
+}
+
+bool JobSystem::takeJob(int workerIndex, Job &job)
+{
+    // Run the newest job from our own queue first.
+    // Its data is most likely to still be in the cache.
+    if(workerIndex >= 0)
+    {
+        Worker* worker = workers_[workerIndex];
+        lock_guard<mutex> lock(worker->jobsMutex);
+        if(!worker->jobs.empty())
+        {
+            job = worker->jobs.back();
+            worker->jobs.pop_back();
+            queuedJobs_ --;
+            return true;
+        }
+    }
+
+    // Steal the oldest job from another worker.
+    // Older jobs tend to be bigger pieces of work.
+    int workerCount = (int)workers_.size();
+    int start = (workerIndex >= 0) ? workerIndex + 1 : (int)(nextWorker_ % workerCount);
+    for(int i = 0; i < workerCount; ++i)
+    {
+        Worker* victim = workers_[(start + i) % workerCount];
+        lock_guard<mutex> lock(victim->jobsMutex);
+        if(!victim->jobs.empty())
+        {
+            job = victim->jobs.front();
+            victim->jobs.pop_front();
+            queuedJobs_ --;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void JobSystem::runJob(Job &job)
+{
+    job.run();
+
+    // The counter may be deleted by a waiting thread as soon as it
+    // reaches zero, so it must not be used after this point.
+    if(job.counter != NULL)
+    {
+        job.counter->count_ --;
+    }
+}
+
+int JobSystem::currentWorkerIndex() const
+{
+    return (currentJobSystem == this) ? currentWorker : -1;
+}
+
+void JobSystem::lowerThreadPriority()
+{
+#if defined(__APPLE__)
+    // Utility QoS runs below the user interactive main thread
+    pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#else
+    // On linux the nice value applies to the calling thread only
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 5);
+#endif
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Counts the unfinished jobs in a group so they can be waited on.
+class JobCounter
+{
+public:
+    JobCounter() : count_(0) { }
+
+    // True once every job added to the counter has finished
+    bool done() const { return count_ == 0; }
+
+private:
+    friend class JobSystem;
+
+    atomic<int> count_;
+};
+
+// A job waiting to run
+struct Job
+{
+    function<void()> run;
+
+    // Decremented when the job finishes. May be NULL.
+    JobCounter* counter;
+};
+
+// Runs jobs on a fixed set of worker threads.
+// Each worker has its own queue. Workers run their newest jobs first
+// and steal the oldest jobs from other workers when theirs is empty.
+// Workers run at a lower priority than the main thread so background
+// work does not hold up rendering.
+class JobSystem
+{
+public:
+    JobSystem(int workerCount);
+    ~JobSystem();
+
+    // The job system shared by the whole application.
+    // Created on first use.
+    static JobSystem* shared();
+
+    // Sets the worker count of the shared job system.
+    // Must be called before its first use.
+    static void setSharedWorkerCount(int workerCount);
+
+    // One worker per hardware thread
+    static int defaultWorkerCount();
+
+    int workerCount() const { return (int)workers_.size(); }
+
+    // Queues a job. The counter is incremented now
+    // and decremented once the job has finished.
+    void submit(const function<void()> &task, JobCounter* counter = NULL);
+
+    // Waits for every job in the counter to finish.
+    // The calling thread runs queued jobs while it waits.
+    void wait(JobCounter* counter);
+
+    // Splits [0, count) into ranges and runs them in parallel.
+    // Returns once every range is processed.
+    void parallelFor(int count, int rangeCount, const function<void(int first, int last)> &rangeTask);
+
+private:
+    struct Worker
+    {
+        deque<Job> jobs;
+        mutex jobsMutex;
+        thread workerThread;
+    };
+
+    vector<Worker*> workers_;
+
+    // The number of jobs in all of the queues
+    atomic<int> queuedJobs_;
+
+    // Used to choose a queue for jobs submitted from other threads
+    atomic<unsigned int> nextWorker_;
+
+    // Idle workers sleep until more jobs are queued
+    mutex sleepMutex_;
+    condition_variable wakeCondition_;
+    bool stopping_;
+
+    // Runs on each worker thread
+    void workerLoop(int workerIndex);
+
+    // Takes the next job for a worker. Other threads pass a
+    // worker index of -1 and can only steal jobs.
+    // Returns false if every queue is empty.
+    bool takeJob(int workerIndex, Job &job);
+
+    // Runs a job and updates its counter
+    void runJob(Job &job);
+
+    // The worker index of the calling thread, or -1
+    int currentWorkerIndex() const;
+
+    // Lowers the scheduling priority of the calling thread
+    static void lowerThreadPriority();
+};
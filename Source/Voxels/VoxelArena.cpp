@@ -0,0 +1,93 @@
+#include "VoxelArena.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+#include <sys/mman.h>
+
+const size_t VoxelArena::MaxReservedBytes;
+const size_t VoxelArena::MinCommitBytes;
+
+VoxelArena::VoxelArena()
+    : data_(NULL),
+    reservedBytes_(0),
+    committedBytes_(0)
+{
+    // Reserve as much address space as the OS allows, up to the maximum.
+    // Reserved pages cannot be accessed and use no memory.
+    for(size_t sizeBytes = MaxReservedBytes; sizeBytes >= MinCommitBytes; sizeBytes /= 2)
+    {
+        void* reservation = mmap(NULL, sizeBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(reservation != MAP_FAILED)
+        {
+            data_ = (char*)reservation;
+            reservedBytes_ = sizeBytes;
+            break;
+        }
+    }
+
+    if(data_ == NULL)
+    {
+        printf("Failed to reserve voxel arena address space \n");
+    }
+}
+
+VoxelArena::~VoxelArena()
+{
+    if(data_ != NULL)
+    {
+        munmap(data_, reservedBytes_);
+    }
+}
+
+bool VoxelArena::commit(size_t sizeBytes)
+{
+    // Most calls are already committed
+    if(sizeBytes <= committedBytes_)
+    {
+        return true;
+    }
+
+    lock_guard<mutex> lock(commitMutex_);
+    return commitLocked(sizeBytes);
+}
+
+void VoxelArena::enableHugePages()
+{
+#if defined(MADV_HUGEPAGE)
+    if(data_ != NULL)
+    {
+        madvise(data_, reservedBytes_, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+bool VoxelArena::commitLocked(size_t sizeBytes)
+{
+    // Another thread may have committed it while we waited
+    size_t committedBytes = committedBytes_;
+    if(sizeBytes <= committedBytes)
+    {
+        return true;
+    }
+
+    if(sizeBytes > reservedBytes_)
+    {
+        return false;
+    }
+
+    // Grow by at least the committed size so the number of commits is
+    // logarithmic in the final size. Small blocks only commit kilobytes.
+    size_t newCommittedBytes = std::max(sizeBytes, std::max(committedBytes * 2, MinCommitBytes));
+    newCommittedBytes = (newCommittedBytes + MinCommitBytes - 1) / MinCommitBytes * MinCommitBytes;
+    newCommittedBytes = std::min(newCommittedBytes, reservedBytes_);
+
+    // The pages are only backed by memory when first written
+    if(mprotect(data_ + committedBytes, newCommittedBytes - committedBytes, PROT_READ | PROT_WRITE) != 0)
+    {
+        return false;
+    }
+
+    committedBytes_ = newCommittedBytes;
+    return true;
+}
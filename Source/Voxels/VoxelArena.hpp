@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+
+using namespace std;
+
+// A block of memory that can grow without moving.
+// The address space is reserved up front and pages are
+// committed as the used part of the block grows.
+class VoxelArena
+{
+    // The most address space reserved by an arena
+    const static size_t MaxReservedBytes = (size_t)16 * 1024 * 1024 * 1024;
+
+    // The smallest amount of memory committed at once
+    const static size_t MinCommitBytes = 64 * 1024;
+
+public:
+    VoxelArena();
+    ~VoxelArena();
+
+    // The start of the block
+    void* data() const { return data_; }
+
+    // The size of the reserved address space and the committed memory
+    size_t reservedBytes() const { return reservedBytes_; }
+    size_t committedBytes() const { return committedBytes_; }
+
+    // Makes sure the first sizeBytes of the block can be used.
+    // Safe to call from multiple threads. Returns false if the
+    // size is bigger than the reservation or the commit fails.
+    bool commit(size_t sizeBytes);
+
+    // Asks the OS to back the block with huge pages where possible.
+    // Does nothing on platforms without transparent huge pages.
+    void enableHugePages();
+
+private:
+    char* data_;
+    size_t reservedBytes_;
+
+    // Increases only. Read without the lock by the commit fast path.
+    atomic<size_t> committedBytes_;
+    mutex commitMutex_;
+
+    // Commits more of the block. The commit mutex must be held.
+    bool commitLocked(size_t sizeBytes);
+};
@@ -1,120 +1,246 @@
 #include "VoxelBuilder.hpp"
 
 #include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include <climits>
 #include <cstdio>
 #include <cstring>
 
-VoxelBuilder::VoxelBuilder(int tileIndex, int resolution, float* entryDepths, float* exitDepths)
+#include "JobSystem.hpp"
+#include "VoxelLevelBuilder.hpp"
+
+VoxelBuilder::VoxelBuilder(int tileIndex, int resolution, const VoxelRasterizer* rasterizer, const Bounds &bounds, VoxelWriter* writer,
+    VoxelDepthFormat depthFormat, VoxelBuildMode buildMode)
     : tileIndex_(tileIndex),
     resolution_(resolution),
-    entryDepths_(entryDepths),
-    exitDepths_(exitDepths),
+    rasterizer_(rasterizer),
+    bounds_(bounds),
+    entryDepths_(NULL),
+    exitDepths_(NULL),
+    depthFormat_(depthFormat),
+    buildMode_(buildMode),
     buildState_(VoxelBuilderState::Building),
     depthMap_(NULL),
-    writer_(NULL),
-    leafCache_(NULL)
+    writer_(writer),
+    rootAddress_(0),
+    reusedRoot_(false)
 {
-    // Start the build thread
-    buildThread_ = std::thread(&VoxelBuilder::build, this);
+
 }
 
 VoxelBuilder::~VoxelBuilder()
 {
-    // Ensure the build thread has finished
-    buildThread_.join();
-    
     // Delete the depth map
     if(depthMap_ != NULL)
     {
         delete depthMap_;
     }
-    
-    // Delete the writer
-    if(writer_ != NULL)
+}
+
+void VoxelBuilder::build()
+{
+    // The nodes only depend on the depths, so a tile with the same
+    // depths as a finished tile can point at its root instead. Tiles
+    // without any shadow casters are found without rendering them.
+    if(!rasterizer_->overlapsTriangles(bounds_) && writer_->findTileRoot(FarDepthsHash, &rootAddress_))
     {
-        delete writer_;
+        reusedRoot_ = true;
+        buildState_ = VoxelBuilderState::Done;
+        return;
     }
     
-    // Delete the leaf cache
-    if(leafCache_ != NULL)
+    // Get the entry and exit depths for the tile
+    renderDepths();
+    
+    uint64_t depthHash = hashDepths();
+    if(writer_->findTileRoot(depthHash, &rootAddress_))
     {
-        delete[] leafCache_;
+        delete[] entryDepths_;
+        delete[] exitDepths_;
+        reusedRoot_ = true;
+        buildState_ = VoxelBuilderState::Done;
+        return;
     }
-}
-
-void VoxelBuilder::build()
-{
-    // Create the building objects
-    createDepthMap();
-    createWriter();
-    createLeafCache();
     
     // The root tile covers the entire region.
     VoxelTile root;
     root.x = 0;
     root.y = 0;
     root.z = 0;
-    root.width = depthMap_->resolution();
-    root.depth = depthMap_->resolution();
+    root.width = resolution_;
+    root.depth = resolution_;
     
-    // Process the root tile
-    // This recursively processes all tiles
-    uint64_t hash;
-    rootAddress_ = processTile(root, &hash);
+    // Create the building objects
+    createDepthMap();
+    
+    if(buildMode_ == VoxelBuildMode::Levels)
+    {
+        // Build the whole tile a level at a time
+        VoxelLevelBuilder levelBuilder(depthMap_, writer_);
+        rootAddress_ = levelBuilder.build();
+    }
+    else
+    {
+        VoxelBuildContext context;
+        createNodeCaches(root, &context);
+        
+        // Process the root tile
+        // This recursively processes all tiles
+        VoxelMirrorHashes hashes;
+        int mirror;
+        int changeZ;
+        rootAddress_ = processTile(root, &context, &hashes, &mirror, &changeZ);
+        
+        // The node caches are no longer needed
+        deleteNodeCaches(&context);
+    }
     
     // The depth map is no longer needed
     delete depthMap_;
     depthMap_ = NULL;
     
-    // The leaf cache is no longer needed
-    delete[] leafCache_;
-    leafCache_ = NULL;
-    
-    // The writer *is* still needed, as it contains the built tree.
+    // Later tiles with the same depths can use the root
+    writer_->addTileRoot(depthHash, rootAddress_);
     
     // Update the build state
     buildState_ = VoxelBuilderState::Done;
 }
 
+void VoxelBuilder::renderDepths()
+{
+    // The depth map takes ownership of the arrays
+    size_t pixelCount = (size_t)resolution_ * (size_t)resolution_;
+    entryDepths_ = new float[pixelCount];
+    exitDepths_ = new float[pixelCount];
+    
+    // Render front faces as the entry depths and back faces as the exit depths.
+    // The rows are split between jobs.
+    rasterizer_->render(bounds_, resolution_, entryDepths_, exitDepths_);
+}
+
+uint64_t VoxelBuilder::hashDepths() const
+{
+    // Hash pairs of depths as 64 bit words. The resolution is a
+    // multiple of 8, so there is an even number of depths.
+    size_t wordCount = (size_t)resolution_ * (size_t)resolution_ / 2;
+    const uint64_t* entryWords = (const uint64_t*)entryDepths_;
+    const uint64_t* exitWords = (const uint64_t*)exitDepths_;
+    
+    // A word of two far plane depths
+    const float farDepths[2] = { 1.0f, 1.0f };
+    uint64_t farWord;
+    memcpy(&farWord, farDepths, sizeof(farWord));
+    
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
+    uint64_t notFar = 0;
+    for(size_t i = 0; i < wordCount; ++i)
+    {
+        hash = (hash ^ entryWords[i]) * 0xbf58476d1ce4e5b9ULL;
+        hash = (hash ^ exitWords[i]) * 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 29;
+        notFar |= (entryWords[i] ^ farWord) | (exitWords[i] ^ farWord);
+    }
+    
+    if(notFar == 0)
+    {
+        return FarDepthsHash;
+    }
+    
+    return hash;
+}
+
 void VoxelBuilder::createDepthMap()
 {
     // The constructor builds the depth hierarchy.
-    // This is slow so should be run from the builder thread.
-    depthMap_ = new VoxelDepthMap(resolution_, entryDepths_, exitDepths_);
+    // The mip rows are split between jobs.
+    depthMap_ = new VoxelDepthMap(resolution_, entryDepths_, exitDepths_, depthFormat_);
 }
 
-void VoxelBuilder::createWriter()
+// The number of leaf columns covered by a column at a cache level
+static inline int cacheLevelShift(int level)
 {
-    // The writer will store the created nodes.
-    writer_ = new VoxelWriter();
+    return std::max(0, level - 1);
 }
 
-void VoxelBuilder::createLeafCache()
+void VoxelBuilder::createNodeCaches(const VoxelTile &tile, VoxelBuildContext* context) const
 {
-    // Create the leaf cache.
-    // There is one cache per 8x8 tile in the depth map.
-    int leafTileCount = (resolution_ / 8) * (resolution_ / 8);
-    leafCache_ = new VoxelLeafCache[leafTileCount];
-    
-    // Set each tile's change distance to 0 so they will be computed on first use
-    std::memset(leafCache_, 0, leafTileCount * sizeof(VoxelLeafCache));
+    // Create the caches.
+    // There is one cache per column at each level, from the
+    // 8x8 leaf columns up to the column of the tile itself.
+    context->cacheX = tile.x / 8;
+    context->cacheY = tile.y / 8;
+    context->cacheWidth = tile.width / 8;
+    context->cacheLevels = (int)log2(tile.width / 8) + 2;
+    assert(context->cacheLevels <= VoxelBuildContext::MaxCacheLevels);
+    
+    for(int level = 0; level < context->cacheLevels; ++level)
+    {
+        int levelWidth = context->cacheWidth >> cacheLevelShift(level);
+        size_t columnCount = (size_t)levelWidth * levelWidth;
+        context->caches[level] = new VoxelNodeCache[columnCount];
+        
+        // Set each node's change depth to 0 so they will be built on first use
+        std::memset(context->caches[level], 0, columnCount * sizeof(VoxelNodeCache));
+    }
 }
 
-VoxelPointer VoxelBuilder::processTile(const VoxelTile &tile, VoxelNodeHash* hash)
+void VoxelBuilder::deleteNodeCaches(VoxelBuildContext* context) const
 {
-    if(tile.depth == 1)
+    for(int level = 0; level < context->cacheLevels; ++level)
     {
-        // Treat as a leaf tile if it is an 8x8x1 block
-        return processLeafTile(tile, hash);
+        delete[] context->caches[level];
     }
-    else
+    
+    context->cacheLevels = 0;
+}
+
+VoxelNodeCache* VoxelBuilder::getCachedNode(const VoxelTile &tile, VoxelBuildContext* context) const
+{
+    // Leaves are 1 deep. Inner tiles are cubes with power of two widths.
+    int level = (tile.depth == 1) ? 0 : __builtin_ctz(tile.width / 8) + 1;
+    assert(level < context->cacheLevels);
+    
+    // Find the tile's column in the level
+    int shift = cacheLevelShift(level);
+    int columnX = (tile.x / 8 - context->cacheX) >> shift;
+    int columnY = (tile.y / 8 - context->cacheY) >> shift;
+    int levelWidth = context->cacheWidth >> shift;
+    assert(columnX >= 0 && columnX < levelWidth);
+    assert(columnY >= 0 && columnY < levelWidth);
+    
+    return &context->caches[level][(size_t)columnY * levelWidth + columnX];
+}
+
+VoxelPointer VoxelBuilder::processTile(const VoxelTile &tile, VoxelBuildContext* context,
+    VoxelMirrorHashes* hashes, int* mirror, int* changeZ)
+{
+    // Leaf tiles (8x8x1 blocks) are processed together by their parent
+    assert(tile.depth > 1);
+    
+    // Check if the node built higher up the column is still valid at this depth
+    VoxelNodeCache* cachedNode = getCachedNode(tile, context);
+    if(tile.z < cachedNode->changeZ)
     {
-        // Otherwise treat as a normal inner tile
-        return processInnerTile(tile, hash);
+        // Reuse the whole subtree
+        *hashes = cachedNode->hashes;
+        *mirror = cachedNode->mirror;
+        *changeZ = cachedNode->changeZ;
+        return cachedNode->location;
     }
+    
+    VoxelPointer location = processInnerTile(tile, context, hashes, mirror, changeZ);
+    
+    // Later tiles in the column may reuse the node
+    cachedNode->location = location;
+    cachedNode->changeZ = *changeZ;
+    cachedNode->mirror = *mirror;
+    cachedNode->hashes = *hashes;
+    return location;
 }
 
-VoxelPointer VoxelBuilder::processInnerTile(const VoxelTile &tile, VoxelNodeHash* hash)
+VoxelPointer VoxelBuilder::processInnerTile(const VoxelTile &tile, VoxelBuildContext* context,
+    VoxelMirrorHashes* hashes, int* mirror, int* changeZ)
 {
     // The tile should be a cube of at least size 8
     assert(tile.width >= 8);
@@ -126,12 +252,18 @@ VoxelPointer VoxelBuilder::processInnerTile(const VoxelTile &tile, VoxelNodeHash
     
     // Create the node
     VoxelInnerNode node;
+    node.paddingBits = 0;
     
     // Get the child mask
-    node.childMask = depthMap_->sampleChildMask(children);
+    int maskChangeDistance;
+    node.childMask = depthMap_->sampleChildMask(children, &maskChangeDistance);
     
-    // Store the hash for each child node
-    VoxelNodeHash childHashes[8];
+    // The node stays the same down the column until the child
+    // mask or any of the expanded children change.
+    int changeDistance = maskChangeDistance;
+    
+    // Store the mirror hashes for each child node
+    VoxelMirrorHashes childHashes[8];
     
     // Track the number of expanded children
     int visitedChildren = 0;
@@ -142,63 +274,261 @@ VoxelPointer VoxelBuilder::processInnerTile(const VoxelTile &tile, VoxelNodeHash
         // Expand the child if it is mixed
         if(node.isChildExpanded(i))
         {
-            // Get the position of the child
-            VoxelTile child = children[i];
-            
-            // Process the child
-            node.childPositions[visitedChildren] = processTile(child, &childHashes[i]);
+            // Large children are processed together in parallel below.
+            // Leaf children are processed together in one batch.
+            if(!isParallelTile(tile) && tile.width > 8)
+            {
+                // Get the position of the child
+                VoxelTile child = children[i];
+                
+                // Process the child
+                int childMirror;
+                int childChangeZ;
+                node.childPositions[visitedChildren] = processTile(child, context, &childHashes[i], &childMirror, &childChangeZ);
+                node.setChildMirror(i, childMirror);
+                changeDistance = std::min(changeDistance, childChangeZ - child.z);
+            }
             
             // Keep track of how many expanded children have been visited.
             visitedChildren ++;
         }
-        else
+    }
+    
+    int childrenChangeDistance = INT_MAX;
+    if(tile.width == 8)
+    {
+        processLeafChildren(children, &node, context, childHashes, &childrenChangeDistance);
+    }
+    else if(isParallelTile(tile))
+    {
+        processChildrenParallel(children, &node, context, childHashes, &childrenChangeDistance);
+    }
+    
+    changeDistance = std::min(changeDistance, childrenChangeDistance);
+    *changeZ = (int)std::min((int64_t)tile.z + changeDistance, (int64_t)INT_MAX);
+    
+    // Compute the hashes of the node's mirror images.
+    // Non-expanded children are hashed using the child mask.
+    computeMirrorHashes(node.childMask, tile.width == 8, childHashes, hashes);
+    
+    // The root pointer cannot hold a mirror, so the root is saved as it is
+    if(tile.width == resolution_)
+    {
+        *mirror = 0;
+        return writer_->writeNode(node, visitedChildren, hashes->hashes[0]);
+    }
+    
+    // Save the smallest mirror of the node and return its memory address.
+    return writer_->writeCanonicalNode(node, visitedChildren, tile.width == 8, *hashes, mirror);
+}
+
+void VoxelBuilder::processChildrenParallel(const VoxelTile* children, VoxelInnerNode* node,
+    VoxelBuildContext* context, VoxelMirrorHashes* childHashes, int* changeDistance)
+{
+    // The z children of a quadrant share cache columns, so are built by
+    // the same job in the same order as the serial build.
+    VoxelBuildContext quadrantContexts[4];
+    VoxelPointer childRoots[8];
+    int childMirrors[8];
+    int childChangeZs[8];
+    
+    // Start a job for each quadrant with expanded children
+    JobSystem* jobSystem = JobSystem::shared();
+    JobCounter quadrantJobs;
+    for(int quadrant = 0; quadrant < 4; ++quadrant)
+    {
+        if(!node->isChildExpanded(quadrant * 2) && !node->isChildExpanded(quadrant * 2 + 1))
         {
-            // The child is not expanded.
-            // For hashing, use the child mask instead.
-            childHashes[i] = node.childMask;
+            quadrantContexts[quadrant].cacheLevels = 0;
+            continue;
         }
+        
+        jobSystem->submit([this, quadrant, children, node, context, &quadrantContexts, &childRoots, &childMirrors, &childChangeZs, childHashes]()
+        {
+            // Each job has its own node caches, starting from the
+            // parent's cached nodes for the same columns.
+            VoxelBuildContext* quadrantContext = &quadrantContexts[quadrant];
+            createNodeCaches(children[quadrant * 2], quadrantContext);
+            copyNodeCaches(*context, quadrantContext);
+            
+            for(int i = quadrant * 2; i < quadrant * 2 + 2; ++i)
+            {
+                if(node->isChildExpanded(i))
+                {
+                    childRoots[i] = processTile(children[i], quadrantContext, &childHashes[i], &childMirrors[i], &childChangeZs[i]);
+                }
+            }
+        }, &quadrantJobs);
     }
     
-    // Compute the node hash
-    *hash = computeInnerNodeHash(childHashes);
+    // Help with the quadrant jobs until they are done
+    jobSystem->wait(&quadrantJobs);
+    
+    // Store the child pointers in child order
+    *changeDistance = INT_MAX;
+    int visitedChildren = 0;
+    for(int i = 0; i < 8; ++i)
+    {
+        if(node->isChildExpanded(i))
+        {
+            node->childPositions[visitedChildren] = childRoots[i];
+            node->setChildMirror(i, childMirrors[i]);
+            *changeDistance = std::min(*changeDistance, childChangeZs[i] - children[i].z);
+            visitedChildren ++;
+        }
+    }
     
-    // Save the node and return its memory address.
-    return writer_->writeNode(node, visitedChildren, *hash);
+    // Later tiles in the same columns continue from the quadrant caches
+    for(int quadrant = 0; quadrant < 4; ++quadrant)
+    {
+        copyNodeCachesBack(quadrantContexts[quadrant], context);
+        deleteNodeCaches(&quadrantContexts[quadrant]);
+    }
 }
 
-VoxelPointer VoxelBuilder::processLeafTile(const VoxelTile &tile, VoxelNodeHash* hash)
+void VoxelBuilder::copyNodeCaches(const VoxelBuildContext &source, VoxelBuildContext* destination) const
 {
-    // The tile should be of width 8 and depth 1
-    assert(tile.width == 8);
-    assert(tile.depth == 1);
+    // The destination must be inside the source
+    assert(destination->cacheLevels <= source.cacheLevels);
     
-    // Get the cache for this tile.
-    int leafIndex = (tile.y / 8) * (depthMap_->resolution() / 8) + (tile.x / 8);
-    VoxelLeafCache* cachedLeaf = &leafCache_[leafIndex];
+    for(int level = 0; level < destination->cacheLevels; ++level)
+    {
+        int shift = cacheLevelShift(level);
+        int sourceWidth = source.cacheWidth >> shift;
+        int destinationWidth = destination->cacheWidth >> shift;
+        int offsetX = (destination->cacheX - source.cacheX) >> shift;
+        int offsetY = (destination->cacheY - source.cacheY) >> shift;
+        assert(offsetX >= 0 && offsetX + destinationWidth <= sourceWidth);
+        assert(offsetY >= 0 && offsetY + destinationWidth <= sourceWidth);
+        
+        for(int y = 0; y < destinationWidth; ++y)
+        {
+            for(int x = 0; x < destinationWidth; ++x)
+            {
+                size_t sourceIndex = (size_t)(y + offsetY) * sourceWidth + (x + offsetX);
+                size_t destinationIndex = (size_t)y * destinationWidth + x;
+                destination->caches[level][destinationIndex] = source.caches[level][sourceIndex];
+            }
+        }
+    }
+}
+
+void VoxelBuilder::copyNodeCachesBack(const VoxelBuildContext &source, VoxelBuildContext* destination) const
+{
+    // The source must be inside the destination
+    assert(source.cacheLevels <= destination->cacheLevels);
     
-    // Check if the cached leaf node is still valid at this depth
-    if(tile.z < cachedLeaf->changeZ)
+    for(int level = 0; level < source.cacheLevels; ++level)
+    {
+        int shift = cacheLevelShift(level);
+        int sourceWidth = source.cacheWidth >> shift;
+        int destinationWidth = destination->cacheWidth >> shift;
+        int offsetX = (source.cacheX - destination->cacheX) >> shift;
+        int offsetY = (source.cacheY - destination->cacheY) >> shift;
+        assert(offsetX >= 0 && offsetX + sourceWidth <= destinationWidth);
+        assert(offsetY >= 0 && offsetY + sourceWidth <= destinationWidth);
+        
+        for(int y = 0; y < sourceWidth; ++y)
+        {
+            for(int x = 0; x < sourceWidth; ++x)
+            {
+                size_t sourceIndex = (size_t)y * sourceWidth + x;
+                size_t destinationIndex = (size_t)(y + offsetY) * destinationWidth + (x + offsetX);
+                destination->caches[level][destinationIndex] = source.caches[level][sourceIndex];
+            }
+        }
+    }
+}
+
+bool VoxelBuilder::isParallelTile(const VoxelTile &tile) const
+{
+    // Splitting the work only pays off with more than one worker
+    if(JobSystem::shared()->workerCount() < 2)
     {
-        // Reuse the cached tile
-        *hash = cachedLeaf->hash;
-        return cachedLeaf->location;
+        return false;
     }
     
-    // Create a new leaf node
-    VoxelLeafNode leafNode;
+    // Only tiles in the top levels with large enough children
+    return tile.width > (resolution_ >> ParallelLevels) && tile.width / 2 >= MinParallelWidth;
+}
+
+void VoxelBuilder::processLeafChildren(const VoxelTile* children, VoxelInnerNode* node,
+    VoxelBuildContext* context, VoxelMirrorHashes* childHashes, int* changeDistance)
+{
+    // The leaves are 8x8x1 blocks in the same column
+    assert(children[0].width == 8);
+    assert(children[0].depth == 1);
+    
+    // Get the cache for the column.
+    VoxelNodeCache* cachedLeaf = getCachedNode(children[0], context);
+    *changeDistance = INT_MAX;
+    
+    // The leaves that need writing, and the new leaf used by each child.
+    // A child using the cached leaf from before this node has no new leaf.
+    VoxelLeafNode newLeaves[8];
+    int newLeafCount = 0;
+    int childNewLeaves[8];
+    int childMirrors[8];
+    int cachedNewLeaf = -1;
     
-    // Sample the depth map to create the leaf mask
-    leafNode.leafMask = depthMap_->sampleLeafMask(tile.x, tile.y, tile.z, &cachedLeaf->changeZ);
+    for(int i = 0; i < 8; ++i)
+    {
+        childNewLeaves[i] = -1;
+        if(!node->isChildExpanded(i))
+        {
+            continue;
+        }
+        
+        // Check if the cached leaf node is still valid at this depth
+        if(children[i].z < cachedLeaf->changeZ)
+        {
+            // Reuse the cached tile
+            childHashes[i] = cachedLeaf->hashes;
+            childMirrors[i] = cachedLeaf->mirror;
+            childNewLeaves[i] = cachedNewLeaf;
+            *changeDistance = std::min(*changeDistance, cachedLeaf->changeZ - children[i].z);
+            continue;
+        }
+        
+        // Sample the depth map to create the leaf mask.
+        // The mirrored leafmasks are the hashes.
+        uint64_t leafMask = depthMap_->sampleLeafMask(children[i].x, children[i].y, children[i].z, &cachedLeaf->changeZ);
+        childHashes[i] = computeLeafMirrorHashes(leafMask);
+        *changeDistance = std::min(*changeDistance, cachedLeaf->changeZ - children[i].z);
+        
+        // The smallest mirror of the leaf is saved
+        newLeaves[newLeafCount].leafMask = canonicalLeafMask(leafMask, &childMirrors[i]);
+        
+        // Later children may reuse the leaf
+        cachedLeaf->hashes = childHashes[i];
+        cachedLeaf->mirror = childMirrors[i];
+        cachedNewLeaf = newLeafCount;
+        childNewLeaves[i] = newLeafCount;
+        newLeafCount ++;
+    }
     
-    // The leafmask is the hash
-    *hash = leafNode.leafMask;
+    // Save the new leaf nodes
+    VoxelPointer newLeafLocations[8];
+    writer_->writeLeaves(newLeaves, newLeafCount, newLeafLocations);
     
-    // Save the leaf node and return its memory address.
-    VoxelPointer ptr = writer_->writeLeaf(leafNode);
-    cachedLeaf->location = ptr;
-    cachedLeaf->hash = *hash;
+    // Store the child pointers in child order
+    int visitedChildren = 0;
+    for(int i = 0; i < 8; ++i)
+    {
+        if(node->isChildExpanded(i))
+        {
+            int newLeaf = childNewLeaves[i];
+            node->childPositions[visitedChildren] = (newLeaf >= 0) ? newLeafLocations[newLeaf] : cachedLeaf->location;
+            node->setChildMirror(i, childMirrors[i]);
+            visitedChildren ++;
+        }
+    }
     
-    return ptr;
+    // Update the cached leaf location
+    if(cachedNewLeaf >= 0)
+    {
+        cachedLeaf->location = newLeafLocations[cachedNewLeaf];
+    }
 }
 
 void VoxelBuilder::getChildLocations(const VoxelTile &parent, VoxelTile* children) const
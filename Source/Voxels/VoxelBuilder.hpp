@@ -1,89 +1,184 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
-#include <thread>
 
+#include "Bounds.hpp"
 #include "VoxelDepthMap.hpp"
+#include "VoxelRasterizer.hpp"
 #include "VoxelWriter.hpp"
 #include "VoxelNode.hpp"
 
-struct VoxelLeafCache
+// A node reused down its column until the depths say it changes
+struct VoxelNodeCache
 {
-    // The pointer to the leaf node
+    // The pointer to the node
     VoxelPointer location;
     
-    // The z depth where the leaf next changes
+    // The z depth where the node next changes.
+    // Nodes in the same column starting above it are the same.
     int changeZ;
     
-    // The hash of the cached leaf node
-    VoxelNodeHash hash;
+    // The mirror that gives back the node from the stored node
+    int mirror;
+    
+    // The hashes of the cached node's mirror images
+    VoxelMirrorHashes hashes;
+};
+
+// The node caches used by a build task.
+// Parallel subtrees are built with their own context.
+struct VoxelBuildContext
+{
+    // Enough levels for any tile width
+    const static int MaxCacheLevels = 24;
+    
+    // The columns covered by the task.
+    // Position and width are in leaves.
+    int cacheX;
+    int cacheY;
+    int cacheWidth;
+    
+    // Level 0 caches a leaf per 8x8 column. Level n caches an inner
+    // node of width 8 << (n - 1) per column of the same width.
+    int cacheLevels;
+    VoxelNodeCache* caches[MaxCacheLevels];
+};
+
+// How the builder constructs the tree
+enum class VoxelBuildMode
+{
+    // Tiles are processed depth first, reusing nodes down their columns
+    Recursive,
+    
+    // Each level is built as a whole, from the leaves up (see VoxelLevelBuilder)
+    Levels
 };
 
 // State of the builder
 enum class VoxelBuilderState
 {
-    // Building is underway on a background thread
+    // Building has not finished
     Building,
     
     // Building is finished
     Done
 };
 
-// Builds a voxel tree structure.
+// Builds a voxel tree structure for a single tile.
 class VoxelBuilder
 {
+    // The children of nodes in the top levels of the tile
+    // are built in parallel.
+    const static int ParallelLevels = 3;
+    
+    // Smaller subtrees are not worth the cost of a separate job
+    const static int MinParallelWidth = 256;
+    
+    // The depth hash of tiles where every depth is the far plane
+    const static uint64_t FarDepthsHash = 0;
+    
 public:
-    VoxelBuilder(int tileIndex, int resolution, float* entryDepths, float* exitDepths);
+    // The nodes are written straight into the writer, which
+    // may be shared with other builders running at the same time.
+    // depthFormat is the type used to store the tile's depths.
+    VoxelBuilder(int tileIndex, int resolution, const VoxelRasterizer* rasterizer, const Bounds &bounds, VoxelWriter* writer,
+        VoxelDepthFormat depthFormat = VoxelDepthFormat::Float, VoxelBuildMode buildMode = VoxelBuildMode::Recursive);
     ~VoxelBuilder();
     
+    // Builds the tree. This is slow, so should be run as a job.
+    void build();
+    
     // The index of the tile being built
     int tileIndex() const { return tileIndex_; }
     
-    // The current build state
-    VoxelBuilderState buildState() const { return buildState_; }
-    
-    // Tree data
-    const void* tree() const { return writer_->data(); }
-    size_t treeSizeWords() const { return writer_->dataSizeWords(); }
-    size_t treeSizeBytes() const { return writer_->dataSizeBytes(); }
+    // The current build state.
+    // Safe to call from any thread.
+    VoxelBuilderState buildState() const { return buildState_.load(); }
     
-    // Root node position
+    // Root node position in the writer
     VoxelPointer rootAddress() const { return rootAddress_; }
     
+    // True if the tile has no shadow casters or the same depths as a
+    // finished tile, so its root was reused without building it
+    bool reusedRoot() const { return reusedRoot_; }
+    
 private:
     
     // The index of the tile being built
     int tileIndex_;
     
-    // The input depth values
+    // The tile resolution
     int resolution_;
+    
+    // Renders the input depth values covering the tile bounds
+    const VoxelRasterizer* rasterizer_;
+    Bounds bounds_;
     float* entryDepths_;
     float* exitDepths_;
+    VoxelDepthFormat depthFormat_;
+    VoxelBuildMode buildMode_;
 
-    // The thread used for building and current state
-    std::thread buildThread_;
-    VoxelBuilderState buildState_;
+    // The current state.
+    // Set by the build job and read by other threads.
+    atomic<VoxelBuilderState> buildState_;
     
     // Objects used during building
     VoxelDepthMap* depthMap_;
+    
+    // Stores the created nodes. Not owned by the builder.
     VoxelWriter* writer_;
-    VoxelLeafCache* leafCache_;
     
     // The address of the root node.
     VoxelPointer rootAddress_;
+    bool reusedRoot_;
 
-    // Builds the tree. Called from the background thread.
-    void build();
+    // Renders the dual shadow map for the tile
+    void renderDepths();
+    
+    // Hashes the rendered depths. Returns FarDepthsHash if
+    // every depth is the far plane, as when nothing is rendered.
+    uint64_t hashDepths() const;
     
     // Creates objects used for tree construction
     void createDepthMap();
-    void createWriter();
-    void createLeafCache();
     
-    // Tile processing. Returns the hash of the tile node
-    VoxelPointer processTile(const VoxelTile &tile, VoxelNodeHash* hash);
-    VoxelPointer processInnerTile(const VoxelTile &tile, VoxelNodeHash* hash);
-    VoxelPointer processLeafTile(const VoxelTile &tile, VoxelNodeHash* hash);
+    // Creates node caches covering the columns of a tile
+    void createNodeCaches(const VoxelTile &tile, VoxelBuildContext* context) const;
+    void deleteNodeCaches(VoxelBuildContext* context) const;
+    
+    // The cache entry for the column of a tile
+    VoxelNodeCache* getCachedNode(const VoxelTile &tile, VoxelBuildContext* context) const;
+    
+    // Tile processing. Returns the location of the stored node, the
+    // mirror that gives back the tile node from it, the hashes of the
+    // tile node's mirror images and the z where it next changes. Tiles
+    // in the same column starting above changeZ are the same, so reuse
+    // the node from the cache. The root is stored without a mirror.
+    VoxelPointer processTile(const VoxelTile &tile, VoxelBuildContext* context,
+        VoxelMirrorHashes* hashes, int* mirror, int* changeZ);
+    VoxelPointer processInnerTile(const VoxelTile &tile, VoxelBuildContext* context,
+        VoxelMirrorHashes* hashes, int* mirror, int* changeZ);
+    
+    // Samples the expanded leaf children of an 8x8x8 tile and
+    // writes the new leaves together in one batch.
+    // Outputs how far the leaves can move down before any changes.
+    void processLeafChildren(const VoxelTile* children, VoxelInnerNode* node,
+        VoxelBuildContext* context, VoxelMirrorHashes* childHashes, int* changeDistance);
+    
+    // Builds the expanded children as parallel jobs. There is one job per
+    // x,y quadrant, which builds the two z children in order. Each job has
+    // a copy of the node caches for its columns.
+    // Outputs how far the children can move down before any changes.
+    void processChildrenParallel(const VoxelTile* children, VoxelInnerNode* node,
+        VoxelBuildContext* context, VoxelMirrorHashes* childHashes, int* changeDistance);
+    
+    // Copies the cache entries covered by the destination
+    void copyNodeCaches(const VoxelBuildContext &source, VoxelBuildContext* destination) const;
+    void copyNodeCachesBack(const VoxelBuildContext &source, VoxelBuildContext* destination) const;
+    
+    // True if the children of the tile should be built in parallel
+    bool isParallelTile(const VoxelTile &tile) const;
     
     // Computes the location and size of the 8 children of a tile
     void getChildLocations(const VoxelTile &parent, VoxelTile* children) const;
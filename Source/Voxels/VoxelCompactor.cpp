@@ -0,0 +1,283 @@
+#include "VoxelCompactor.hpp"
+
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include <unordered_map>
+
+VoxelCompactor::VoxelCompactor(const uint32_t* tree, size_t treeSizeWords, int rootCount, int tileResolution)
+    : tree_(tree),
+    treeSizeWords_(treeSizeWords),
+    rootCount_(rootCount),
+    treeHeight_((int)log2(tileResolution) - 1)
+{
+    // The bottom level holds the leaves
+    assert(treeHeight_ > 1);
+
+    findLevels();
+}
+
+VoxelCompactionStats VoxelCompactor::compact(int maxLeafError, VoxelWriter* writer)
+{
+    assert(maxLeafError >= 0 && maxLeafError <= MaxLeafError);
+    assert(writer->dataSizeWords() == 0);
+
+    VoxelCompactionStats stats;
+    stats.leafCount = levels_.back().size();
+    stats.sizeWordsBefore = treeSizeWords_;
+    stats.leafVoxels = 0;
+    for(const LevelNode &leaf : levels_.back())
+    {
+        stats.leafVoxels += leaf.instances * 64;
+    }
+
+    // Choose the leaf each leaf is replaced by.
+    // Mirroring keeps the number of differing voxels.
+    vector<uint64_t> leafMasks = mergeLeaves(maxLeafError, &stats.mergedLeafCount, &stats.errorVoxels);
+
+    // The new tree has the same layout as a built tree
+    writer->reserveRootNodePointerSpace(rootCount_);
+
+    // Write the smallest mirror of each leaf.
+    // The mirrored masks are the hashes.
+    vector<VoxelPointer> childLocations(leafMasks.size());
+    vector<VoxelMirrorHashes> childHashes(leafMasks.size());
+    vector<int> childMirrors(leafMasks.size());
+    for(size_t i = 0; i < leafMasks.size(); ++i)
+    {
+        VoxelLeafNode leaf;
+        leaf.leafMask = canonicalLeafMask(leafMasks[i], &childMirrors[i]);
+        childLocations[i] = writer->writeLeaf(leaf);
+        childHashes[i] = computeLeafMirrorHashes(leafMasks[i]);
+    }
+
+    // Rewrite the inner nodes from the bottom up, pointing at the new children.
+    // Nodes that now have the same children are written once.
+    for(int height = treeHeight_ - 2; height >= 0; --height)
+    {
+        const vector<LevelNode> &nodes = levels_[height];
+        const vector<LevelNode> &children = levels_[height + 1];
+        vector<VoxelPointer> locations(nodes.size());
+        vector<VoxelMirrorHashes> hashes(nodes.size());
+        vector<int> mirrors(nodes.size());
+        bool leafChildren = (height == treeHeight_ - 2);
+
+        for(size_t i = 0; i < nodes.size(); ++i)
+        {
+            VoxelInnerNode node = decodeInnerNode(tree_, nodes[i].location);
+            VoxelMirrorHashes nodeChildHashes[8];
+
+            int visitedChildren = 0;
+            for(int child = 0; child < 8; ++child)
+            {
+                if(node.isChildExpanded(child))
+                {
+                    // The child is a mirror of the old stored child,
+                    // which is now a mirror of the new stored child
+                    size_t childIndex = levelIndex(children, node.childPositions[visitedChildren]);
+                    int childMirror = node.childMirror(child);
+                    node.childPositions[visitedChildren] = childLocations[childIndex];
+                    node.setChildMirror(child, childMirror ^ childMirrors[childIndex]);
+                    for(int image = 0; image < VoxelMirrorCount; ++image)
+                    {
+                        nodeChildHashes[child].hashes[image] = childHashes[childIndex].hashes[image ^ childMirror];
+                    }
+
+                    visitedChildren ++;
+                }
+            }
+
+            computeMirrorHashes(node.childMask, leafChildren, nodeChildHashes, &hashes[i]);
+
+            // The root pointers cannot hold a mirror
+            if(height == 0)
+            {
+                mirrors[i] = 0;
+                locations[i] = writer->writeNode(node, visitedChildren, hashes[i].hashes[0]);
+            }
+            else
+            {
+                locations[i] = writer->writeCanonicalNode(node, visitedChildren, leafChildren, hashes[i], &mirrors[i]);
+            }
+        }
+
+        childLocations.swap(locations);
+        childHashes.swap(hashes);
+        childMirrors.swap(mirrors);
+    }
+
+    // Point each tile at its new root
+    for(int i = 0; i < rootCount_; ++i)
+    {
+        writer->setRootNodePointer(i, childLocations[levelIndex(levels_[0], tree_[i])]);
+    }
+
+    stats.sizeWordsAfter = writer->dataSizeWords();
+    return stats;
+}
+
+void VoxelCompactor::findLevels()
+{
+    levels_.resize(treeHeight_);
+
+    // Each tile root is used once
+    for(int i = 0; i < rootCount_; ++i)
+    {
+        LevelNode root;
+        root.location = tree_[i];
+        root.instances = 1;
+        levels_[0].push_back(root);
+    }
+
+    combineNodes(&levels_[0]);
+
+    // A child appears once for every time each of its parents appears
+    for(int height = 0; height < treeHeight_ - 1; ++height)
+    {
+        for(const LevelNode &parent : levels_[height])
+        {
+            assert(parent.location < treeSizeWords_);
+            VoxelInnerNode node = decodeInnerNode(tree_, parent.location);
+
+            int visitedChildren = 0;
+            for(int i = 0; i < 8; ++i)
+            {
+                if(node.isChildExpanded(i))
+                {
+                    LevelNode child;
+                    child.location = node.childPositions[visitedChildren];
+                    child.instances = parent.instances;
+                    levels_[height + 1].push_back(child);
+                    visitedChildren ++;
+                }
+            }
+        }
+
+        combineNodes(&levels_[height + 1]);
+    }
+}
+
+void VoxelCompactor::combineNodes(vector<LevelNode>* nodes)
+{
+    std::sort(nodes->begin(), nodes->end(), [](const LevelNode &a, const LevelNode &b)
+    {
+        return a.location < b.location;
+    });
+
+    // Add up the instances of each node
+    size_t combinedCount = 0;
+    for(size_t i = 0; i < nodes->size(); ++i)
+    {
+        if(combinedCount > 0 && (*nodes)[combinedCount - 1].location == (*nodes)[i].location)
+        {
+            (*nodes)[combinedCount - 1].instances += (*nodes)[i].instances;
+        }
+        else
+        {
+            (*nodes)[combinedCount++] = (*nodes)[i];
+        }
+    }
+
+    nodes->resize(combinedCount);
+}
+
+vector<uint64_t> VoxelCompactor::mergeLeaves(int maxLeafError, size_t* mergedLeafCount, uint64_t* errorVoxels) const
+{
+    const vector<LevelNode> &leaves = levels_.back();
+    vector<uint64_t> masks(leaves.size());
+    for(size_t i = 0; i < leaves.size(); ++i)
+    {
+        masks[i] = ((const VoxelLeafNode*)(tree_ + leaves[i].location))->leafMask;
+    }
+
+    *mergedLeafCount = 0;
+    *errorVoxels = 0;
+    vector<uint64_t> replacements = masks;
+    if(maxLeafError == 0)
+    {
+        return replacements;
+    }
+
+    // The most used leaves are kept first, so the leaves that change
+    // cover as few voxels as possible
+    vector<uint32_t> order(leaves.size());
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = (uint32_t)i;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&leaves](uint32_t a, uint32_t b)
+    {
+        return leaves[a].instances > leaves[b].instances;
+    });
+
+    // The kept leaves, by the value of each chunk of their mask.
+    // The key is the chunk index followed by the chunk bits.
+    int chunkCount = maxLeafError + 1;
+    unordered_map<uint64_t, vector<uint32_t> > chunkBuckets;
+
+    for(uint32_t leaf : order)
+    {
+        uint64_t mask = masks[leaf];
+        uint64_t chunkKeys[MaxLeafError + 1];
+
+        // Find the nearest kept leaf sharing a chunk
+        int bestLeaf = -1;
+        int bestError = maxLeafError + 1;
+        for(int chunk = 0; chunk < chunkCount; ++chunk)
+        {
+            int firstBit = chunk * 64 / chunkCount;
+            int lastBit = (chunk + 1) * 64 / chunkCount;
+            uint64_t chunkBits = (mask >> firstBit) & ((1ULL << (lastBit - firstBit)) - 1);
+            chunkKeys[chunk] = ((uint64_t)chunk << 32) | chunkBits;
+
+            auto bucket = chunkBuckets.find(chunkKeys[chunk]);
+            if(bucket == chunkBuckets.end())
+            {
+                continue;
+            }
+
+            int candidateCount = std::min((int)bucket->second.size(), (int)MaxBucketCandidates);
+            for(int i = 0; i < candidateCount; ++i)
+            {
+                uint32_t candidate = bucket->second[i];
+                int error = __builtin_popcountll(mask ^ masks[candidate]);
+                if(error < bestError)
+                {
+                    bestLeaf = candidate;
+                    bestError = error;
+                }
+            }
+        }
+
+        if(bestLeaf >= 0)
+        {
+            // Replace the leaf. The kept leaf never changes,
+            // so the error is bounded.
+            replacements[leaf] = masks[bestLeaf];
+            *errorVoxels += leaves[leaf].instances * bestError;
+            (*mergedLeafCount) ++;
+        }
+        else
+        {
+            // Keep the leaf so later leaves can merge with it
+            for(int chunk = 0; chunk < chunkCount; ++chunk)
+            {
+                chunkBuckets[chunkKeys[chunk]].push_back(leaf);
+            }
+        }
+    }
+
+    return replacements;
+}
+
+size_t VoxelCompactor::levelIndex(const vector<LevelNode> &level, VoxelPointer location)
+{
+    auto node = std::lower_bound(level.begin(), level.end(), location, [](const LevelNode &a, VoxelPointer b)
+    {
+        return a.location < b;
+    });
+
+    assert(node != level.end() && node->location == location);
+    return node - level.begin();
+}
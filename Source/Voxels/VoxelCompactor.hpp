@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "VoxelNode.hpp"
+#include "VoxelWriter.hpp"
+
+using namespace std;
+
+// The result of a lossy compaction
+struct VoxelCompactionStats
+{
+    // The number of unique leaves, and how many were replaced
+    // by a similar leaf
+    size_t leafCount;
+    size_t mergedLeafCount;
+
+    // The tree size before and after
+    size_t sizeWordsBefore;
+    size_t sizeWordsAfter;
+
+    // The voxels stored in leaves across the full tree, counting every
+    // time a shared leaf is used, and how many changed shadowing
+    uint64_t leafVoxels;
+    uint64_t errorVoxels;
+};
+
+// Shrinks a finished tree by merging leaves that differ by a few voxels.
+// Each leaf is replaced by the most used similar leaf, then the tree is
+// rewritten. Inner nodes whose leaves become the same are then merged by
+// the writer, so whole subtrees merge too.
+//
+// Similar leaves are found with multi-index hashing. The mask is split
+// into maxLeafError + 1 chunks. Masks within maxLeafError bits of each
+// other must match exactly in at least one chunk.
+class VoxelCompactor
+{
+    // Leaves can differ by at most this many voxels
+    const static int MaxLeafError = 15;
+
+    // The most leaves compared from each chunk bucket
+    const static int MaxBucketCandidates = 32;
+
+public:
+    // The tree starts with rootCount root pointers, each pointing
+    // at a tile of the specified resolution. It must stay valid while
+    // the compactor is used.
+    VoxelCompactor(const uint32_t* tree, size_t treeSizeWords, int rootCount, int tileResolution);
+
+    // Rewrites the tree into an empty writer, replacing each leaf by
+    // a leaf that differs by at most maxLeafError voxels.
+    VoxelCompactionStats compact(int maxLeafError, VoxelWriter* writer);
+
+private:
+    // A node that appears in the tree, and the number
+    // of times it appears when the tree is fully expanded
+    struct LevelNode
+    {
+        VoxelPointer location;
+        uint64_t instances;
+    };
+
+    const uint32_t* tree_;
+    size_t treeSizeWords_;
+    int rootCount_;
+    int treeHeight_;
+
+    // The distinct nodes at each height, from the roots down to
+    // the leaves, sorted by location
+    vector<vector<LevelNode> > levels_;
+
+    // Finds the nodes at each height of the tree
+    void findLevels();
+
+    // Sorts the nodes of a level and combines the duplicates
+    static void combineNodes(vector<LevelNode>* nodes);
+
+    // Chooses a replacement mask for each leaf. Outputs the
+    // number of leaves changed and the voxels changed.
+    vector<uint64_t> mergeLeaves(int maxLeafError, size_t* mergedLeafCount, uint64_t* errorVoxels) const;
+
+    // The index of a node in a level
+    static size_t levelIndex(const vector<LevelNode> &level, VoxelPointer location);
+};
@@ -1,142 +1,453 @@
 #include "VoxelDepthMap.hpp"
 
 #include <math.h>
+#include <algorithm>
+#include <climits>
+#include <limits>
 
-VoxelDepthMap::VoxelDepthMap(int resolution, float* entryDepths, float* exitDepths)
-    : resolution_(resolution)
+#include "JobSystem.hpp"
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
+
+const int VoxelDepthMap::BlockWidth;
+const int VoxelDepthMap::FirstMip;
+
+VoxelDepthMap::VoxelDepthMap(int resolution, float* entryDepths, float* exitDepths, VoxelDepthFormat format)
+    : resolution_(resolution),
+    format_(format),
+    leafMaskKernel_(voxelLeafMaskKernel()),
+    leafMaskKernelUInt16_(voxelLeafMaskKernelUInt16())
 {
-    // Must be a +vs resolution
-    assert(resolution_ > 0);
+    // Must be a power of two made of whole blocks
+    assert(resolution_ >= BlockWidth * 2);
+    assert((resolution_ & (resolution_ - 1)) == 0);
+    
+    // uint16 depths cannot hold larger resolutions
+    assert(format_ != VoxelDepthFormat::UInt16 || quantizedFormat(resolution_) == VoxelDepthFormat::UInt16);
     
     // Compute the number of mip levels needed. There is no
     // level for the last 1x1 mip as it is not needed.
     mipHierarchyHeight_ = log2(resolution);
     
-    // Create the hierarchy
-    entryDepths_ = new float*[mipHierarchyHeight_];
-    exitDepths_ = new float*[mipHierarchyHeight_];
+    // Fill the blocks, then build the mips from them
+    switch(format_)
+    {
+        case VoxelDepthFormat::Float:
+            buildHierarchy<float>(entryDepths, exitDepths);
+            break;
+            
+        case VoxelDepthFormat::UInt16:
+            buildHierarchy<uint16_t>(entryDepths, exitDepths);
+            break;
+            
+        case VoxelDepthFormat::UInt32:
+            buildHierarchy<uint32_t>(entryDepths, exitDepths);
+            break;
+    }
+}
+
+VoxelDepthMap::~VoxelDepthMap()
+{
+    switch(format_)
+    {
+        case VoxelDepthFormat::Float:
+            deleteHierarchy<float>();
+            break;
+            
+        case VoxelDepthFormat::UInt16:
+            deleteHierarchy<uint16_t>();
+            break;
+            
+        case VoxelDepthFormat::UInt32:
+            deleteHierarchy<uint32_t>();
+            break;
+    }
+}
+
+VoxelDepthFormat VoxelDepthMap::quantizedFormat(int resolution)
+{
+    // The leaf test compares 2z with entry + exit, which must fit in 17 bits
+    return (resolution <= 32768) ? VoxelDepthFormat::UInt16 : VoxelDepthFormat::UInt32;
+}
+
+// Interleaves the bits of x and y to give the Morton order index.
+// x is in the low bit, so the 2x2 groups are (0,0) (1,0) (0,1) (1,1).
+static inline size_t mortonIndex(uint32_t x, uint32_t y)
+{
+    // Spread x and y at the same time, in the low and high halves
+    assert(x < 65536 && y < 65536);
+    uint64_t bits = ((uint64_t)y << 32) | x;
+    bits = (bits | (bits << 16)) & 0x0000FFFF0000FFFFULL;
+    bits = (bits | (bits << 8)) & 0x00FF00FF00FF00FFULL;
+    bits = (bits | (bits << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    bits = (bits | (bits << 2)) & 0x3333333333333333ULL;
+    bits = (bits | (bits << 1)) & 0x5555555555555555ULL;
+    return (size_t)((bits & 0xFFFFFFFF) | (bits >> 31));
+}
+
+// Converts a rendered depth to whole voxels, rounded up or down.
+// Out of range and missing depths are clamped.
+template<typename T>
+static inline T convertDepth(float depth, int resolution, bool roundUp)
+{
+    // The leaf kernels use ints, so depths never exceed INT_MAX
+    const T maxDepth = (T)std::min<uint64_t>(std::numeric_limits<T>::max(), INT_MAX);
     
-    // The top tree level has already been created
-    entryDepths_[0] = entryDepths;
-    exitDepths_[0] = exitDepths;
+    depth = depth * resolution;
+    depth = roundUp ? ceilf(depth) : floorf(depth);
+    
+    return (depth != depth) ? (roundUp ? maxDepth : 0)
+        : (depth <= 0.0f) ? 0
+        : (depth >= (float)maxDepth) ? maxDepth
+        : (T)depth;
+}
 
-    // Create the mip levels
-    for(int mip = 1; mip < mipHierarchyHeight_; ++mip)
+// Converts the depths to T. The order of the depths is kept.
+template<typename T>
+static T* convertDepths(float* depths, int resolution, bool roundUp)
+{
+    T* convertedDepths = new T[(size_t)resolution * resolution];
+    
+    // The rows are independent so are split between jobs
+    JobSystem* jobSystem = JobSystem::shared();
+    jobSystem->parallelFor(resolution, jobSystem->workerCount() * 4, [=](int firstRow, int lastRow)
     {
-        // Halve the resolution with each mip level
-        int parentResolution = resolution;
-        resolution /= 2;
-        int mipResolution = resolution;
-        
-        // Make the arrays
-        entryDepths_[mip] = new float[mipResolution * mipResolution];
-        exitDepths_[mip] = new float[mipResolution * mipResolution];
-        
-        // Consider row in the parent mip
-        for(int parentRow = 0; parentRow < parentResolution; ++parentRow)
+        for(size_t i = (size_t)firstRow * resolution; i < (size_t)lastRow * resolution; ++i)
         {
-            // Consider each element in the row, in pairs
-            for(int i = 0; i < mipResolution; ++i)
-            {
-                int parentIndex = parentRow * parentResolution + i*2;
-                int mipIndex = parentRow/2 * mipResolution + i;
-                
-                // Get the min exit depth from the pair
-                float entry0 = entryDepths_[mip-1][parentIndex];
-                float entry1 = entryDepths_[mip-1][parentIndex + 1];
-                float entryMax = std::max(entry0, entry1);
-                
-                // Get the max exit depth from the pair
-                float exit0 = exitDepths_[mip-1][parentIndex];
-                float exit1 = exitDepths_[mip-1][parentIndex +1];
-                float exitMin = std::min(exit0, exit1);
-                
-                if((parentRow % 2) == 0)
-                {
-                    // If it is an even row, we haven't computed the other 2 values yet
-                    entryDepths_[mip][mipIndex] = entryMax;
-                    exitDepths_[mip][mipIndex] = exitMin;
-                }
-                else
-                {
-                    // If an odd row, combine the 2 values with the other values computed earlier
-                    entryDepths_[mip][mipIndex] = std::max(entryDepths_[mip][mipIndex], entryMax);
-                    exitDepths_[mip][mipIndex] = std::min(exitDepths_[mip][mipIndex], exitMin);
-                }
-            }
+            convertedDepths[i] = convertDepth<T>(depths[i], resolution, roundUp);
         }
+    });
+    
+    // The float depths are no longer needed
+    delete[] depths;
+    return convertedDepths;
+}
+
+// Float depths are used as they are
+template<>
+float* convertDepths<float>(float* depths, int, bool)
+{
+    return depths;
+}
+
+template<typename T>
+void VoxelDepthMap::buildHierarchy(float* entryDepths, float* exitDepths)
+{
+    // Entry depths are rounded up and exit depths rounded down, so
+    // regions are only classified as shadowed or unshadowed if they
+    // would be with the float depths. Missing entry depths never
+    // shadow and missing exit depths never unshadow.
+    // Each float array is freed as soon as it is converted.
+    entryDepths_ = convertDepths<T>(entryDepths, resolution_, true);
+    exitDepths_ = convertDepths<T>(exitDepths, resolution_, false);
+    
+    // Create the mip levels
+    mipDepths_ = new void*[mipHierarchyHeight_];
+    for(int mip = 0; mip < mipHierarchyHeight_; ++mip)
+    {
+        size_t mipResolution = (size_t)resolution_ >> mip;
+        mipDepths_[mip] = (mip >= FirstMip) ? new T[mipResolution * mipResolution * 2] : NULL;
+    }
+    
+    // Fill them
+    buildFirstMip<T>();
+    for(int mip = FirstMip + 1; mip < mipHierarchyHeight_; ++mip)
+    {
+        buildMipLevel<T>(mip);
     }
 }
 
-VoxelDepthMap::~VoxelDepthMap()
+template<typename T>
+void VoxelDepthMap::deleteHierarchy()
 {
+    delete[] (T*)entryDepths_;
+    delete[] (T*)exitDepths_;
+    
     // Delete the mip levels
-    for(int i = 0; i < mipHierarchyHeight_; ++i)
+    for(int mip = 0; mip < mipHierarchyHeight_; ++mip)
     {
-        delete[] entryDepths_[i];
-        delete[] exitDepths_[i];
+        delete[] (T*)mipDepths_[mip];
     }
     
-    // Delete the main arrays
-    delete[] entryDepths_;
-    delete[] exitDepths_;
+    delete[] mipDepths_;
 }
 
-uint64_t VoxelDepthMap::sampleLeafMask(int x, int y, int z, int* nextChangeZ) const
+// Reduces two parent rows of quantized depths to one mip row.
+// Takes the max entry depth and min exit depth of each 2x2 block.
+template<typename T>
+static void reduceMipRow(const T* entryRow0, const T* entryRow1, const T* exitRow0, const T* exitRow1,
+    T* mipEntry, T* mipExit, int mipResolution)
 {
-    // Check the voxel is within the bounds
-    assert(x >= 0 && x < resolution_);
-    assert(y >= 0 && y < resolution_);
-    assert(z >= 0 && z < resolution_);
+    for(int i = 0; i < mipResolution; ++i)
+    {
+        mipEntry[i] = std::max(std::max(entryRow0[i*2], entryRow0[i*2 + 1]), std::max(entryRow1[i*2], entryRow1[i*2 + 1]));
+        mipExit[i] = std::min(std::min(exitRow0[i*2], exitRow0[i*2 + 1]), std::min(exitRow1[i*2], exitRow1[i*2 + 1]));
+    }
+}
+
+// Reduces two parent rows to one mip row.
+// Takes the max entry depth and min exit depth of each 2x2 block.
+// The comparisons match std::max(a, b) and std::min(a, b) exactly,
+// including which operand is kept when a depth is NaN.
+static void reduceMipRow(const float* entryRow0, const float* entryRow1, const float* exitRow0, const float* exitRow1,
+    float* mipEntry, float* mipExit, int mipResolution)
+{
+    int i = 0;
     
-    // Create the leaf mask
-    uint64_t leafMask = 0;
+#if defined(__SSE2__)
+    // 4 mip depths at a time. The even and odd parent
+    // depths are separated with shuffles.
+    for(; i + 4 <= mipResolution; i += 4)
+    {
+        __m128 entry0a = _mm_loadu_ps(entryRow0 + i*2);
+        __m128 entry0b = _mm_loadu_ps(entryRow0 + i*2 + 4);
+        __m128 entry1a = _mm_loadu_ps(entryRow1 + i*2);
+        __m128 entry1b = _mm_loadu_ps(entryRow1 + i*2 + 4);
+        __m128 exit0a = _mm_loadu_ps(exitRow0 + i*2);
+        __m128 exit0b = _mm_loadu_ps(exitRow0 + i*2 + 4);
+        __m128 exit1a = _mm_loadu_ps(exitRow1 + i*2);
+        __m128 exit1b = _mm_loadu_ps(exitRow1 + i*2 + 4);
+        
+        // _mm_max_ps(b, a) keeps a when unordered, like std::max(a, b)
+        __m128 entryMax0 = _mm_max_ps(_mm_shuffle_ps(entry0a, entry0b, _MM_SHUFFLE(3, 1, 3, 1)),
+                                      _mm_shuffle_ps(entry0a, entry0b, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128 entryMax1 = _mm_max_ps(_mm_shuffle_ps(entry1a, entry1b, _MM_SHUFFLE(3, 1, 3, 1)),
+                                      _mm_shuffle_ps(entry1a, entry1b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(mipEntry + i, _mm_max_ps(entryMax1, entryMax0));
+        
+        __m128 exitMin0 = _mm_min_ps(_mm_shuffle_ps(exit0a, exit0b, _MM_SHUFFLE(3, 1, 3, 1)),
+                                     _mm_shuffle_ps(exit0a, exit0b, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128 exitMin1 = _mm_min_ps(_mm_shuffle_ps(exit1a, exit1b, _MM_SHUFFLE(3, 1, 3, 1)),
+                                     _mm_shuffle_ps(exit1a, exit1b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(mipExit + i, _mm_min_ps(exitMin1, exitMin0));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // 4 mip depths at a time. vld2q separates the even and odd
+    // parent depths. The selects keep the same operands as std::max.
+    for(; i + 4 <= mipResolution; i += 4)
+    {
+        float32x4x2_t entry0 = vld2q_f32(entryRow0 + i*2);
+        float32x4x2_t entry1 = vld2q_f32(entryRow1 + i*2);
+        float32x4x2_t exit0 = vld2q_f32(exitRow0 + i*2);
+        float32x4x2_t exit1 = vld2q_f32(exitRow1 + i*2);
+        
+        float32x4_t entryMax0 = vbslq_f32(vcltq_f32(entry0.val[0], entry0.val[1]), entry0.val[1], entry0.val[0]);
+        float32x4_t entryMax1 = vbslq_f32(vcltq_f32(entry1.val[0], entry1.val[1]), entry1.val[1], entry1.val[0]);
+        vst1q_f32(mipEntry + i, vbslq_f32(vcltq_f32(entryMax0, entryMax1), entryMax1, entryMax0));
+        
+        float32x4_t exitMin0 = vbslq_f32(vcltq_f32(exit0.val[1], exit0.val[0]), exit0.val[1], exit0.val[0]);
+        float32x4_t exitMin1 = vbslq_f32(vcltq_f32(exit1.val[1], exit1.val[0]), exit1.val[1], exit1.val[0]);
+        vst1q_f32(mipExit + i, vbslq_f32(vcltq_f32(exitMin1, exitMin0), exitMin1, exitMin0));
+    }
+#endif
     
-    // Assume the leafmask is valid for all following z values
-    *nextChangeZ = INT_MAX;
+    // The remaining mip depths, or all of them without SIMD
+    for(; i < mipResolution; ++i)
+    {
+        // Get the max entry depth from the 2x2 block
+        float entryMax0 = std::max(entryRow0[i*2], entryRow0[i*2 + 1]);
+        float entryMax1 = std::max(entryRow1[i*2], entryRow1[i*2 + 1]);
+        mipEntry[i] = std::max(entryMax0, entryMax1);
+        
+        // Get the min exit depth from the 2x2 block
+        float exitMin0 = std::min(exitRow0[i*2], exitRow0[i*2 + 1]);
+        float exitMin1 = std::min(exitRow1[i*2], exitRow1[i*2 + 1]);
+        mipExit[i] = std::min(exitMin0, exitMin1);
+    }
+}
+
+template<typename T>
+void VoxelDepthMap::buildFirstMip()
+{
+    static_assert(BlockWidth == 8 && FirstMip == 3, "Blocks are reduced in three steps");
+    
+    // Each block reduces to one first mip depth pair
+    int blockRows = resolution_ >> FirstMip;
     
-    // Sample the 8x8 voxel grid
-    for(int yOffset = 0; yOffset < 8; ++yOffset)
+    JobSystem* jobSystem = JobSystem::shared();
+    jobSystem->parallelFor(blockRows * blockRows, jobSystem->workerCount() * 4, [this, blockRows](int firstBlock, int lastBlock)
     {
-        for(int xOffset = 0; xOffset < 8; ++xOffset)
+        T* mip = (T*)mipDepths_[FirstMip];
+        
+        for(int block = firstBlock; block < lastBlock; ++block)
         {
-            // Sample row by row to increase cache coherency
-            int voxelX = x + xOffset;
-            int voxelY = y + yOffset;
-            int voxelIndex = voxelY * resolution_ + voxelX;
-            
-            // Get the midpoint of the shadow caster
-            float entryDepth = entryDepths_[0][voxelIndex] * resolution_;
-            float exitDepth = exitDepths_[0][voxelIndex] * resolution_;
-            float doubleShadowMidpoint = (entryDepth + exitDepth);
-
-            // Depth test
-            int shadowed = (z * 2 > doubleShadowMidpoint) ? VS_Shadowed : VS_Unshadowed;
+            size_t mipIndex = mortonIndex(block % blockRows, block / blockRows);
+            const T* entryBlock = (const T*)entryDepths_ + (size_t)block * BlockWidth * BlockWidth;
+            const T* exitBlock = (const T*)exitDepths_ + (size_t)block * BlockWidth * BlockWidth;
             
-            // Add to the leaf mask
-            int index = (xOffset << 3) | yOffset;
-            leafMask |= ((uint64_t)shadowed << index);
+            // 8x8 -> 4x4 -> 2x2 -> 1x1, in the same order as a row major mip chain
+            T entry4[16], exit4[16], entry2[4], exit2[4];
+            for(int row = 0; row < 4; ++row)
+            {
+                reduceMipRow(entryBlock + row * 16, entryBlock + row * 16 + 8, exitBlock + row * 16, exitBlock + row * 16 + 8,
+                    entry4 + row * 4, exit4 + row * 4, 4);
+            }
             
-            // Check if the midpoint depth limits the distance the leafmask
-            // can be reused for.
-            if(exitDepth >= z && exitDepth < *nextChangeZ)
+            for(int row = 0; row < 2; ++row)
             {
-                *nextChangeZ = exitDepth;
+                reduceMipRow(entry4 + row * 8, entry4 + row * 8 + 4, exit4 + row * 8, exit4 + row * 8 + 4,
+                    entry2 + row * 2, exit2 + row * 2, 2);
             }
+            
+            reduceMipRow(entry2, entry2 + 2, exit2, exit2 + 2, &mip[mipIndex * 2], &mip[mipIndex * 2 + 1], 1);
         }
+    });
+}
+
+template<typename T>
+void VoxelDepthMap::buildMipLevel(int mip)
+{
+    // In Morton order the 2x2 parents of each depth pair are the
+    // 4 pairs at 4 times its index, so the level is read in order.
+    int mipResolution = resolution_ >> mip;
+    int pairCount = mipResolution * mipResolution;
+    
+    JobSystem* jobSystem = JobSystem::shared();
+    jobSystem->parallelFor(pairCount, jobSystem->workerCount() * 4, [this, mip](int firstPair, int lastPair)
+    {
+        const T* parent = (const T*)mipDepths_[mip - 1];
+        T* depths = (T*)mipDepths_[mip];
+        
+        for(int i = firstPair; i < lastPair; ++i)
+        {
+            const T* parents = parent + (size_t)i * 8;
+            
+            // Get the max entry depth and min exit depth from the 2x2 block
+            T entryMax0 = std::max(parents[0], parents[2]);
+            T entryMax1 = std::max(parents[4], parents[6]);
+            T exitMin0 = std::min(parents[1], parents[3]);
+            T exitMin1 = std::min(parents[5], parents[7]);
+            
+            depths[(size_t)i * 2] = std::max(entryMax0, entryMax1);
+            depths[(size_t)i * 2 + 1] = std::min(exitMin0, exitMin1);
+        }
+    });
+}
+
+uint64_t VoxelDepthMap::sampleLeafMask(int x, int y, int z, int* nextChangeZ) const
+{
+    // Check the block is within the bounds
+    assert(x >= 0 && x + BlockWidth <= resolution_ && x % BlockWidth == 0);
+    assert(y >= 0 && y + BlockWidth <= resolution_ && y % BlockWidth == 0);
+    assert(z >= 0 && z < resolution_);
+    
+    // The depths of the block are contiguous.
+    // Sample them with the fastest kernel for the format.
+    size_t blockIndex = ((size_t)(y / BlockWidth) * (resolution_ / BlockWidth) + x / BlockWidth) * BlockWidth * BlockWidth;
+    switch(format_)
+    {
+        case VoxelDepthFormat::UInt16:
+            return leafMaskKernelUInt16_((const uint16_t*)entryDepths_ + blockIndex, (const uint16_t*)exitDepths_ + blockIndex,
+                BlockWidth, z, nextChangeZ);
+            
+        case VoxelDepthFormat::UInt32:
+            return sampleLeafMaskUInt32Scalar((const uint32_t*)entryDepths_ + blockIndex, (const uint32_t*)exitDepths_ + blockIndex,
+                BlockWidth, z, nextChangeZ);
+            
+        default:
+            return leafMaskKernel_((const float*)entryDepths_ + blockIndex, (const float*)exitDepths_ + blockIndex,
+                BlockWidth, resolution_, z, nextChangeZ);
+    }
+}
+
+// Converts a stored depth to voxels
+static inline double voxelDepth(float depth, int resolution)
+{
+    return depth * resolution;
+}
+
+// Quantized depths are already in voxels
+template<typename T>
+static inline double voxelDepth(T depth, int)
+{
+    return depth;
+}
+
+// Rounds a depth in voxels down or up to a whole voxel.
+// Depths past the int range, or missing, are clamped to INT_MAX.
+static inline int64_t floorVoxel(double depth)
+{
+    if(!(depth < INT_MAX))
+    {
+        return INT_MAX;
+    }
+    
+    int64_t voxel = (int64_t)std::max(depth, (double)INT_MIN);
+    return (voxel > depth) ? voxel - 1 : voxel;
+}
+
+static inline int64_t ceilVoxel(double depth)
+{
+    if(!(depth < INT_MAX))
+    {
+        return INT_MAX;
+    }
+    
+    int64_t voxel = (int64_t)std::max(depth, (double)INT_MIN);
+    return (voxel < depth) ? voxel + 1 : voxel;
+}
+
+// Determines the shadowing state of a region from its depth bounds.
+// minDepth and maxDepth are already biased by a voxel. Also outputs
+// how far the region can move down in z before the state may change.
+static inline VoxelShadowing regionShadowing(double entryDepth, double exitDepth, int minDepth, int maxDepth, int* changeDistance)
+{
+    // Whole region after shadow entry depth.
+    // Moving down keeps it shadowed.
+    if(minDepth > entryDepth)
+    {
+        *changeDistance = INT_MAX;
+        return VS_Shadowed;
+    }
+    
+    // The region becomes shadowed once its min depth passes the entry depth.
+    // Missing entry depths never shadow.
+    int64_t distance = floorVoxel(entryDepth) + 1 - minDepth;
+    
+    // Whole region before exit depth, until its max depth reaches it
+    if(maxDepth < exitDepth)
+    {
+        distance = std::min(distance, ceilVoxel(exitDepth) - maxDepth);
+        *changeDistance = (int)std::min(distance, (int64_t)INT_MAX);
+        return VS_Unshadowed;
     }
     
-    return leafMask;
+    // Mixed shadowing.
+    // Moving down never makes the region unshadowed.
+    *changeDistance = (int)std::min(distance, (int64_t)INT_MAX);
+    return VS_Mixed;
 }
 
-uint16_t VoxelDepthMap::sampleChildMask(const VoxelTile* children) const
+uint16_t VoxelDepthMap::sampleChildMask(const VoxelTile* children, int* changeDistance) const
+{
+    switch(format_)
+    {
+        case VoxelDepthFormat::UInt16:
+            return sampleChildMask<uint16_t>(children, changeDistance);
+        case VoxelDepthFormat::UInt32:
+            return sampleChildMask<uint32_t>(children, changeDistance);
+        default:
+            return sampleChildMask<float>(children, changeDistance);
+    }
+}
+
+template<typename T>
+uint16_t VoxelDepthMap::sampleChildMask(const VoxelTile* children, int* changeDistance) const
 {
     // Create the child mask
     uint16_t childMask = 0;
     
+    // The mask is the same until any child's state may change
+    *changeDistance = INT_MAX;
+    
     // All the children sample from the same mip
     int mip = log2(children[0].width);
-    int mipResolution = 1 << (mipHierarchyHeight_ - mip);
+    assert(mip >= FirstMip && mip < mipHierarchyHeight_);
+    const T* mipDepths = (const T*)mipDepths_[mip];
     
     // Determine the shadowing state of each child
     for(int index = 0; index < 8; ++index)
@@ -152,24 +463,18 @@ uint16_t VoxelDepthMap::sampleChildMask(const VoxelTile* children) const
         assert(child.z >= 0 && child.z + child.depth <= resolution_);
         
         // Compute the depth bounds of the child region
-        float minDepth = (child.z);
-        float maxDepth = (child.z + child.depth);
-        
         // Bias the min and max depths to avoid self shadowing artifacts
         // A 1 voxel bias in each direction is enough
-        minDepth -= 1.0;
-        maxDepth += 1.0;
-        
-        // Sample the mips
-        int mipIndex = (child.y >> mip) * mipResolution + (child.x >> mip);
-        float entryDepth = entryDepths_[mip][mipIndex] * resolution_;
-        float exitDepth = exitDepths_[mip][mipIndex] * resolution_;
+        int minDepth = child.z - 1;
+        int maxDepth = child.z + child.depth + 1;
         
-        // Determine shadowing state
-        VoxelShadowing childShadowing =
-            minDepth > entryDepth ? VS_Shadowed // Whole region after shadow entry depth
-            : (maxDepth < exitDepth) ? VS_Unshadowed // Whole region before exit depth
-            : VS_Mixed; // Mixed shadowing
+        // Sample the mips and determine shadowing state.
+        // The 4 columns of the children are neighbours in the mip.
+        const T* depthPair = mipDepths + mortonIndex(child.x >> mip, child.y >> mip) * 2;
+        int childChangeDistance;
+        VoxelShadowing childShadowing = regionShadowing(voxelDepth(depthPair[0], resolution_), voxelDepth(depthPair[1], resolution_),
+            minDepth, maxDepth, &childChangeDistance);
+        *changeDistance = std::min(*changeDistance, childChangeDistance);
 
         // Add to the child mask
         childMask |= (childShadowing << (index * 2));
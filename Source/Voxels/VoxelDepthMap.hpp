@@ -6,30 +6,100 @@
 
 #include "Scene.hpp"
 #include "VoxelNode.hpp"
+#include "VoxelLeafMask.hpp"
+
+// The type used to store the depths
+enum class VoxelDepthFormat
+{
+    // Depths in the [0, 1] range, as rendered
+    Float,
+
+    // Depths converted to whole voxels. Entry depths are rounded up and
+    // exit depths are rounded down, so uniform child regions stay uniform.
+    // Leaf masks may differ from the float format by up to one voxel.
+    UInt16,
+    UInt32
+};
 
 // Contains a dual shadow map to determine the shadowing status of voxel regions.
+//
+// The depths are stored in the order the tree reads them. The full
+// resolution depths are split into 8x8 blocks, one per leaf column, so a
+// leaf mask reads a few whole cache lines. The mips are Morton ordered
+// (entry, exit) pairs, so the depths sampled for a node's children share
+// a cache line.
 class VoxelDepthMap
 {
+    // The width of a block of full resolution depths
+    const static int BlockWidth = VoxelLeafWidth;
+
+    // Child masks are never sampled from mips smaller than a block
+    const static int FirstMip = 3;
+
 public:
-    VoxelDepthMap(int resolution, float* entryDepths, float* exitDepths);
+    // Takes ownership of the depth arrays, which are in blocks
+    // (see VoxelRasterizer). With a quantized format the depths
+    // are converted, then freed.
+    VoxelDepthMap(int resolution, float* entryDepths, float* exitDepths,
+        VoxelDepthFormat format = VoxelDepthFormat::Float);
     ~VoxelDepthMap();
 
+    // The smallest quantized format that can hold depths at a resolution.
+    // uint16 covers tiles up to 32K deep, as the leaf test doubles z.
+    static VoxelDepthFormat quantizedFormat(int resolution);
+
     // Depth resolution
     int resolution() const { return resolution_; }
-    
-    // Samples a leaf mask.
+
+    // The type of the stored depths
+    VoxelDepthFormat format() const { return format_; }
+
+    // Samples the leaf mask of the 8x8 block at x, y.
     // Also outputs depth that the leaf mask next changes.
+    // Uses SIMD where the CPU supports it.
     uint64_t sampleLeafMask(int x, int y, int z, int* nextChangeZ) const;
-    
+
     // Samples 8 tile children to construct a childmask.
-    uint16_t sampleChildMask(const VoxelTile* children) const;
-    
+    // Also outputs how far the children can move down in z
+    // before the child mask may change.
+    uint16_t sampleChildMask(const VoxelTile* children, int* changeDistance) const;
+
 private:
     int resolution_;
     int mipHierarchyHeight_;
-    
-    // Hierarchy of depths
+    VoxelDepthFormat format_;
+
+    // Computes leaf masks from the full resolution depths
+    VoxelLeafMaskKernel leafMaskKernel_;
+    VoxelLeafMaskKernelUInt16 leafMaskKernelUInt16_;
+
+    // The full resolution depths, in blocks.
+    // The blocks and the depths in each block are row major.
+    void* entryDepths_;
+    void* exitDepths_;
+
+    // Hierarchy of Morton ordered (entry, exit) depth pairs
     // Ordered highest resolution -> lowest resolution
-    float** entryDepths_;
-    float** exitDepths_;
+    // Levels before FirstMip are not stored.
+    void** mipDepths_;
+
+    // Rearranges and converts the depths, then builds the mips
+    template<typename T>
+    void buildHierarchy(float* entryDepths, float* exitDepths);
+
+    // Builds the first mip from the full resolution blocks
+    template<typename T>
+    void buildFirstMip();
+
+    // Builds a mip from the level above
+    template<typename T>
+    void buildMipLevel(int mip);
+
+    // Deletes the depths and mips
+    template<typename T>
+    void deleteHierarchy();
+
+    // Samples the child mask using depths of type T
+    template<typename T>
+    uint16_t sampleChildMask(const VoxelTile* children, int* changeDistance) const;
 };
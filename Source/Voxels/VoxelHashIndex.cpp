@@ -0,0 +1,179 @@
+#include "VoxelHashIndex.hpp"
+
+#include <assert.h>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+// The table starts at this many groups and doubles when it is 3/4 full
+const size_t InitialGroupCount = 16;
+
+VoxelHashIndex::VoxelHashIndex()
+    : groups_(NULL),
+    groupCount_(0),
+    entryCount_(0)
+{
+
+}
+
+VoxelHashIndex::~VoxelHashIndex()
+{
+    clear();
+}
+
+VoxelPointer VoxelHashIndex::find(VoxelNodeHash hash) const
+{
+    if(groupCount_ == 0)
+    {
+        return EmptyLocation;
+    }
+
+    // The probe stops at an empty entry if the hash is missing
+    return probe(hash)->location;
+}
+
+void VoxelHashIndex::insert(VoxelNodeHash hash, VoxelPointer location)
+{
+    assert(location != EmptyLocation);
+
+    // Keep the table at most 3/4 full so probes stay short
+    if((entryCount_ + 1) * 4 > groupCount_ * 4 * 3)
+    {
+        grow();
+    }
+
+    VoxelHashEntry* entry = probe(hash);
+    assert(entry->location == EmptyLocation);
+
+    entry->hashLow = (uint32_t)hash;
+    entry->hashHigh = (uint32_t)(hash >> 32);
+    entry->location = location;
+    entryCount_ ++;
+}
+
+void VoxelHashIndex::prefetch(VoxelNodeHash hash) const
+{
+    if(groupCount_ == 0)
+    {
+        return;
+    }
+
+    // A group spans at most two cache lines
+    const char* group = (const char*)&groups_[firstGroup(hash)];
+    __builtin_prefetch(group);
+    __builtin_prefetch(group + sizeof(VoxelHashGroup) - 1);
+}
+
+void VoxelHashIndex::clear()
+{
+    delete[] groups_;
+
+    groups_ = NULL;
+    groupCount_ = 0;
+    entryCount_ = 0;
+}
+
+size_t VoxelHashIndex::firstGroup(VoxelNodeHash hash) const
+{
+    // Leaf hashes are raw leaf masks, so the bits are mixed
+    // before they are used to choose a group
+    hash ^= hash >> 31;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 29;
+
+    return (size_t)hash & (groupCount_ - 1);
+}
+
+VoxelHashEntry* VoxelHashIndex::probe(VoxelNodeHash hash) const
+{
+    uint32_t hashLow = (uint32_t)hash;
+    uint32_t hashHigh = (uint32_t)(hash >> 32);
+
+#if defined(__SSE2__)
+    // The pattern matching the 12 words of a group.
+    // The location words are compared to the empty location.
+    const __m128i pattern0 = _mm_setr_epi32(hashLow, hashHigh, EmptyLocation, hashLow);
+    const __m128i pattern1 = _mm_setr_epi32(hashHigh, EmptyLocation, hashLow, hashHigh);
+    const __m128i pattern2 = _mm_setr_epi32(EmptyLocation, hashLow, hashHigh, EmptyLocation);
+#endif
+
+    size_t groupIndex = firstGroup(hash);
+    while(true)
+    {
+        VoxelHashGroup* group = &groups_[groupIndex];
+
+#if defined(__SSE2__)
+        // Compare all 4 entries at once.
+        // Bit n is set if word n of the group matches the pattern.
+        const __m128i* words = (const __m128i*)group;
+        int matches = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(words), pattern0)))
+            | (_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(words + 1), pattern1))) << 4)
+            | (_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(words + 2), pattern2))) << 8);
+
+        // Use the first entry that is empty or has the same hash
+        for(int i = 0; i < 4; ++i)
+        {
+            int entryMatches = (matches >> (i * 3)) & 7;
+            if(entryMatches & 4)
+            {
+                // Empty entry. The hash is not in the table.
+                return &group->entries[i];
+            }
+
+            if(entryMatches == 3)
+            {
+                return &group->entries[i];
+            }
+        }
+#else
+        // Use the first entry that is empty or has the same hash
+        for(int i = 0; i < 4; ++i)
+        {
+            VoxelHashEntry* entry = &group->entries[i];
+            if(entry->location == EmptyLocation
+               || (entry->hashLow == hashLow && entry->hashHigh == hashHigh))
+            {
+                return entry;
+            }
+        }
+#endif
+
+        // Continue to the next group
+        groupIndex = (groupIndex + 1) & (groupCount_ - 1);
+    }
+}
+
+void VoxelHashIndex::grow()
+{
+    VoxelHashGroup* oldGroups = groups_;
+    size_t oldGroupCount = groupCount_;
+
+    // Create the new table with every entry empty
+    groupCount_ = (oldGroupCount == 0) ? InitialGroupCount : oldGroupCount * 2;
+    groups_ = new VoxelHashGroup[groupCount_];
+    for(size_t i = 0; i < groupCount_; ++i)
+    {
+        for(int j = 0; j < 4; ++j)
+        {
+            groups_[i].entries[j].hashLow = 0;
+            groups_[i].entries[j].hashHigh = 0;
+            groups_[i].entries[j].location = EmptyLocation;
+        }
+    }
+
+    // Reinsert the old entries
+    for(size_t i = 0; i < oldGroupCount; ++i)
+    {
+        for(int j = 0; j < 4; ++j)
+        {
+            const VoxelHashEntry &entry = oldGroups[i].entries[j];
+            if(entry.location != EmptyLocation)
+            {
+                *probe(((VoxelNodeHash)entry.hashHigh << 32) | entry.hashLow) = entry;
+            }
+        }
+    }
+
+    delete[] oldGroups;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "VoxelNode.hpp"
+
+// An entry in the hash index.
+// The hash is split into two words so the entry packs into 12 bytes.
+struct VoxelHashEntry
+{
+    uint32_t hashLow;
+    uint32_t hashHigh;
+    VoxelPointer location;
+};
+
+// Entries are probed 4 at a time.
+// A group is 48 bytes, which is three 16 byte SIMD loads.
+struct alignas(16) VoxelHashGroup
+{
+    VoxelHashEntry entries[4];
+};
+
+// Maps node hashes to node locations.
+// An open addressing table with linear probing, used by the writer to
+// find duplicate nodes. It is not thread safe.
+class VoxelHashIndex
+{
+public:
+    // The location of empty entries. Returned when a hash is not found.
+    const static VoxelPointer EmptyLocation = 0xFFFFFFFF;
+
+    VoxelHashIndex();
+    ~VoxelHashIndex();
+
+    // The number of stored hashes
+    size_t size() const { return entryCount_; }
+
+    // The memory used by the table
+    size_t sizeBytes() const { return groupCount_ * sizeof(VoxelHashGroup); }
+
+    // Finds the location stored for a hash.
+    // Returns EmptyLocation if the hash is not in the index.
+    VoxelPointer find(VoxelNodeHash hash) const;
+
+    // Adds a hash that is not already in the index
+    void insert(VoxelNodeHash hash, VoxelPointer location);
+
+    // Starts loading the first group probed for a hash.
+    // Used to overlap the cache misses of several lookups.
+    void prefetch(VoxelNodeHash hash) const;
+
+    // Removes every hash and frees the table
+    void clear();
+
+private:
+    VoxelHashGroup* groups_;
+    size_t groupCount_;
+    size_t entryCount_;
+
+    // The first group probed for a hash
+    size_t firstGroup(VoxelNodeHash hash) const;
+
+    // Finds the entry holding a hash. If there is none, finds
+    // the empty entry where the hash would be inserted.
+    VoxelHashEntry* probe(VoxelNodeHash hash) const;
+
+    // Doubles the number of groups and reinserts every entry
+    void grow();
+};
@@ -0,0 +1,329 @@
+#include "VoxelLeafMask.hpp"
+
+#include <climits>
+#include <math.h>
+
+#include "VoxelNode.hpp"
+
+#if defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
+
+// Moves bit (y * 8 + x) to bit (x * 8 + y).
+// The kernels build the mask a row at a time, but leaf masks are column major.
+static inline uint64_t transposeLeafBits(uint64_t bits)
+{
+    uint64_t t;
+    t = (bits ^ (bits >> 7)) & 0x00AA00AA00AA00AAULL;
+    bits = bits ^ t ^ (t << 7);
+    t = (bits ^ (bits >> 14)) & 0x0000CCCC0000CCCCULL;
+    bits = bits ^ t ^ (t << 14);
+    t = (bits ^ (bits >> 28)) & 0x00000000F0F0F0F0ULL;
+    bits = bits ^ t ^ (t << 28);
+    return bits;
+}
+
+// Converts the smallest exit depth at or below z to the change depth.
+// Matches the scalar kernel, which stores each new minimum as an int.
+static inline int nextChangeZFromExitDepth(float minExitDepth)
+{
+    // Depths that do not fit in an int never replace INT_MAX
+    return (minExitDepth < 2147483648.0f) ? (int)minExitDepth : INT_MAX;
+}
+
+uint64_t sampleLeafMaskScalar(const float* entryDepths, const float* exitDepths,
+    size_t rowStride, int resolution, int z, int* nextChangeZ)
+{
+    // Create the leaf mask
+    uint64_t leafMask = 0;
+
+    // Assume the leafmask is valid for all following z values
+    *nextChangeZ = INT_MAX;
+
+    // Sample the 8x8 voxel grid
+    for(int yOffset = 0; yOffset < 8; ++yOffset)
+    {
+        for(int xOffset = 0; xOffset < 8; ++xOffset)
+        {
+            // Sample row by row to increase cache coherency
+            size_t voxelIndex = (size_t)yOffset * rowStride + xOffset;
+
+            // Get the midpoint of the shadow caster
+            float entryDepth = entryDepths[voxelIndex] * resolution;
+            float exitDepth = exitDepths[voxelIndex] * resolution;
+            float doubleShadowMidpoint = (entryDepth + exitDepth);
+
+            // Depth test
+            int shadowed = (z * 2 > doubleShadowMidpoint) ? VS_Shadowed : VS_Unshadowed;
+
+            // Add to the leaf mask
+            int index = (xOffset << 3) | yOffset;
+            leafMask |= ((uint64_t)shadowed << index);
+
+            // Check if the midpoint depth limits the distance the leafmask
+            // can be reused for.
+            if(exitDepth >= z && exitDepth < *nextChangeZ)
+            {
+                *nextChangeZ = exitDepth;
+            }
+        }
+    }
+
+    return leafMask;
+}
+
+// The quantized kernels use the same tests as the float kernels,
+// with the depths already multiplied by the resolution
+template<typename T>
+static uint64_t sampleQuantizedLeafMask(const T* entryDepths, const T* exitDepths,
+    size_t rowStride, int z, int* nextChangeZ)
+{
+    uint64_t leafMask = 0;
+    int64_t nextChange = INT_MAX;
+
+    for(int yOffset = 0; yOffset < 8; ++yOffset)
+    {
+        for(int xOffset = 0; xOffset < 8; ++xOffset)
+        {
+            size_t voxelIndex = (size_t)yOffset * rowStride + xOffset;
+            int64_t entryDepth = entryDepths[voxelIndex];
+            int64_t exitDepth = exitDepths[voxelIndex];
+
+            // Depth test against the midpoint
+            int shadowed = ((int64_t)z * 2 > entryDepth + exitDepth) ? VS_Shadowed : VS_Unshadowed;
+            leafMask |= ((uint64_t)shadowed << ((xOffset << 3) | yOffset));
+
+            // Exit depths at or below z limit the reuse distance
+            if(exitDepth >= z && exitDepth < nextChange)
+            {
+                nextChange = exitDepth;
+            }
+        }
+    }
+
+    *nextChangeZ = (int)nextChange;
+    return leafMask;
+}
+
+uint64_t sampleLeafMaskUInt16Scalar(const uint16_t* entryDepths, const uint16_t* exitDepths,
+    size_t rowStride, int z, int* nextChangeZ)
+{
+    return sampleQuantizedLeafMask(entryDepths, exitDepths, rowStride, z, nextChangeZ);
+}
+
+uint64_t sampleLeafMaskUInt32Scalar(const uint32_t* entryDepths, const uint32_t* exitDepths,
+    size_t rowStride, int z, int* nextChangeZ)
+{
+    return sampleQuantizedLeafMask(entryDepths, exitDepths, rowStride, z, nextChangeZ);
+}
+
+#if defined(__SSE2__)
+
+uint64_t sampleLeafMaskSSE2(const float* entryDepths, const float* exitDepths,
+    size_t rowStride, int resolution, int z, int* nextChangeZ)
+{
+    const __m128 depthScale = _mm_set1_ps((float)resolution);
+    const __m128 doubleZ = _mm_set1_ps((float)(z * 2));
+    const __m128 depthZ = _mm_set1_ps((float)z);
+    const __m128 infinity = _mm_set1_ps(INFINITY);
+
+    uint64_t rowBits = 0;
+    __m128 minExitDepth = infinity;
+
+    // Each row is processed as two halves of 4 voxels
+    for(int y = 0; y < 8; ++y)
+    {
+        for(int half = 0; half < 2; ++half)
+        {
+            size_t voxelIndex = (size_t)y * rowStride + half * 4;
+            __m128 entryDepth = _mm_mul_ps(_mm_loadu_ps(entryDepths + voxelIndex), depthScale);
+            __m128 exitDepth = _mm_mul_ps(_mm_loadu_ps(exitDepths + voxelIndex), depthScale);
+
+            // Unshadowed voxels are set in the mask
+            __m128 shadowed = _mm_cmpgt_ps(doubleZ, _mm_add_ps(entryDepth, exitDepth));
+            uint64_t unshadowed = ~_mm_movemask_ps(shadowed) & 0xF;
+            rowBits |= unshadowed << (y * 8 + half * 4);
+
+            // Exit depths above z are ignored
+            __m128 limitsChange = _mm_cmpge_ps(exitDepth, depthZ);
+            __m128 limit = _mm_or_ps(_mm_and_ps(limitsChange, exitDepth), _mm_andnot_ps(limitsChange, infinity));
+            minExitDepth = _mm_min_ps(minExitDepth, limit);
+        }
+    }
+
+    // Reduce to the smallest exit depth
+    minExitDepth = _mm_min_ps(minExitDepth, _mm_movehl_ps(minExitDepth, minExitDepth));
+    minExitDepth = _mm_min_ss(minExitDepth, _mm_shuffle_ps(minExitDepth, minExitDepth, 1));
+    *nextChangeZ = nextChangeZFromExitDepth(_mm_cvtss_f32(minExitDepth));
+
+    return transposeLeafBits(rowBits);
+}
+
+__attribute__((target("avx2")))
+uint64_t sampleLeafMaskAVX2(const float* entryDepths, const float* exitDepths,
+    size_t rowStride, int resolution, int z, int* nextChangeZ)
+{
+    const __m256 depthScale = _mm256_set1_ps((float)resolution);
+    const __m256 doubleZ = _mm256_set1_ps((float)(z * 2));
+    const __m256 depthZ = _mm256_set1_ps((float)z);
+    const __m256 infinity = _mm256_set1_ps(INFINITY);
+
+    uint64_t rowBits = 0;
+    __m256 minExitDepth = infinity;
+
+    // One row of 8 voxels at a time
+    for(int y = 0; y < 8; ++y)
+    {
+        size_t voxelIndex = (size_t)y * rowStride;
+        __m256 entryDepth = _mm256_mul_ps(_mm256_loadu_ps(entryDepths + voxelIndex), depthScale);
+        __m256 exitDepth = _mm256_mul_ps(_mm256_loadu_ps(exitDepths + voxelIndex), depthScale);
+
+        // Unshadowed voxels are set in the mask
+        __m256 shadowed = _mm256_cmp_ps(doubleZ, _mm256_add_ps(entryDepth, exitDepth), _CMP_GT_OQ);
+        uint64_t unshadowed = ~_mm256_movemask_ps(shadowed) & 0xFF;
+        rowBits |= unshadowed << (y * 8);
+
+        // Exit depths above z are ignored
+        __m256 limitsChange = _mm256_cmp_ps(exitDepth, depthZ, _CMP_GE_OQ);
+        minExitDepth = _mm256_min_ps(minExitDepth, _mm256_blendv_ps(infinity, exitDepth, limitsChange));
+    }
+
+    // Reduce to the smallest exit depth
+    __m128 minExitDepth4 = _mm_min_ps(_mm256_castps256_ps128(minExitDepth), _mm256_extractf128_ps(minExitDepth, 1));
+    minExitDepth4 = _mm_min_ps(minExitDepth4, _mm_movehl_ps(minExitDepth4, minExitDepth4));
+    minExitDepth4 = _mm_min_ss(minExitDepth4, _mm_shuffle_ps(minExitDepth4, minExitDepth4, 1));
+    *nextChangeZ = nextChangeZFromExitDepth(_mm_cvtss_f32(minExitDepth4));
+
+    return transposeLeafBits(rowBits);
+}
+
+__attribute__((target("avx2")))
+uint64_t sampleLeafMaskUInt16AVX2(const uint16_t* entryDepths, const uint16_t* exitDepths,
+    size_t rowStride, int z, int* nextChangeZ)
+{
+    const __m256i doubleZ = _mm256_set1_epi32(z * 2);
+    const __m256i depthZ = _mm256_set1_epi32(z);
+    const __m256i noChange = _mm256_set1_epi32(INT_MAX);
+
+    uint64_t rowBits = 0;
+    __m256i minExitDepth = noChange;
+
+    // One row of 8 voxels at a time, widened to 32 bits so the sum fits
+    for(int y = 0; y < 8; ++y)
+    {
+        size_t voxelIndex = (size_t)y * rowStride;
+        __m256i entryDepth = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(entryDepths + voxelIndex)));
+        __m256i exitDepth = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(exitDepths + voxelIndex)));
+
+        // Unshadowed voxels are set in the mask
+        __m256i shadowed = _mm256_cmpgt_epi32(doubleZ, _mm256_add_epi32(entryDepth, exitDepth));
+        uint64_t unshadowed = ~_mm256_movemask_ps(_mm256_castsi256_ps(shadowed)) & 0xFF;
+        rowBits |= unshadowed << (y * 8);
+
+        // Exit depths above z are ignored
+        __m256i ignored = _mm256_cmpgt_epi32(depthZ, exitDepth);
+        minExitDepth = _mm256_min_epi32(minExitDepth, _mm256_blendv_epi8(exitDepth, noChange, ignored));
+    }
+
+    // Reduce to the smallest exit depth
+    __m128i minExitDepth4 = _mm_min_epi32(_mm256_castsi256_si128(minExitDepth), _mm256_extracti128_si256(minExitDepth, 1));
+    minExitDepth4 = _mm_min_epi32(minExitDepth4, _mm_shuffle_epi32(minExitDepth4, _MM_SHUFFLE(1, 0, 3, 2)));
+    minExitDepth4 = _mm_min_epi32(minExitDepth4, _mm_shuffle_epi32(minExitDepth4, _MM_SHUFFLE(2, 3, 0, 1)));
+    *nextChangeZ = _mm_cvtsi128_si32(minExitDepth4);
+
+    return transposeLeafBits(rowBits);
+}
+
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+uint64_t sampleLeafMaskNEON(const float* entryDepths, const float* exitDepths,
+    size_t rowStride, int resolution, int z, int* nextChangeZ)
+{
+    const float32x4_t depthScale = vdupq_n_f32((float)resolution);
+    const float32x4_t doubleZ = vdupq_n_f32((float)(z * 2));
+    const float32x4_t depthZ = vdupq_n_f32((float)z);
+    const float32x4_t infinity = vdupq_n_f32(INFINITY);
+    const uint32_t laneBitValues[4] = { 1, 2, 4, 8 };
+    const uint32x4_t laneBits = vld1q_u32(laneBitValues);
+
+    uint64_t rowBits = 0;
+    float32x4_t minExitDepth = infinity;
+
+    // Each row is processed as two halves of 4 voxels
+    for(int y = 0; y < 8; ++y)
+    {
+        for(int half = 0; half < 2; ++half)
+        {
+            size_t voxelIndex = (size_t)y * rowStride + half * 4;
+            float32x4_t entryDepth = vmulq_f32(vld1q_f32(entryDepths + voxelIndex), depthScale);
+            float32x4_t exitDepth = vmulq_f32(vld1q_f32(exitDepths + voxelIndex), depthScale);
+
+            // Unshadowed voxels are set in the mask
+            uint32x4_t shadowed = vcgtq_f32(doubleZ, vaddq_f32(entryDepth, exitDepth));
+            uint64_t unshadowed = ~vaddvq_u32(vandq_u32(shadowed, laneBits)) & 0xF;
+            rowBits |= unshadowed << (y * 8 + half * 4);
+
+            // Exit depths above z are ignored
+            uint32x4_t limitsChange = vcgeq_f32(exitDepth, depthZ);
+            minExitDepth = vminq_f32(minExitDepth, vbslq_f32(limitsChange, exitDepth, infinity));
+        }
+    }
+
+    *nextChangeZ = nextChangeZFromExitDepth(vminvq_f32(minExitDepth));
+
+    return transposeLeafBits(rowBits);
+}
+
+#endif
+
+// Picks the fastest kernel the CPU supports
+static VoxelLeafMaskKernel chooseLeafMaskKernel(const char** name)
+{
+#if defined(__SSE2__)
+    if(__builtin_cpu_supports("avx2"))
+    {
+        *name = "AVX2";
+        return sampleLeafMaskAVX2;
+    }
+
+    *name = "SSE2";
+    return sampleLeafMaskSSE2;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    *name = "NEON";
+    return sampleLeafMaskNEON;
+#else
+    *name = "scalar";
+    return sampleLeafMaskScalar;
+#endif
+}
+
+static const char* leafMaskKernelName = NULL;
+
+VoxelLeafMaskKernel voxelLeafMaskKernel()
+{
+    // Chosen once. Static initialization is thread safe.
+    static VoxelLeafMaskKernel kernel = chooseLeafMaskKernel(&leafMaskKernelName);
+    return kernel;
+}
+
+VoxelLeafMaskKernelUInt16 voxelLeafMaskKernelUInt16()
+{
+#if defined(__SSE2__)
+    static VoxelLeafMaskKernelUInt16 kernel = __builtin_cpu_supports("avx2") ? sampleLeafMaskUInt16AVX2 : sampleLeafMaskUInt16Scalar;
+    return kernel;
+#else
+    return sampleLeafMaskUInt16Scalar;
+#endif
+}
+
+const char* voxelLeafMaskKernelName()
+{
+    voxelLeafMaskKernel();
+    return leafMaskKernelName;
+}
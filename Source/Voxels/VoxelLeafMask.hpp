@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Computes the leaf mask of an 8x8 block of voxels at depth z.
+// The depths point at the first voxel in the block and rows are
+// rowStride floats apart. Bit (x * 8 + y) is set if voxel (x, y) is
+// unshadowed. Also outputs the depth that the leaf mask next changes.
+// Every kernel produces exactly the same results.
+typedef uint64_t (*VoxelLeafMaskKernel)(const float* entryDepths, const float* exitDepths,
+    size_t rowStride, int resolution, int z, int* nextChangeZ);
+
+// The same for depths quantized to whole voxels (see VoxelDepthMap).
+// The depths are already in voxel units, so there is no resolution.
+typedef uint64_t (*VoxelLeafMaskKernelUInt16)(const uint16_t* entryDepths, const uint16_t* exitDepths,
+    size_t rowStride, int z, int* nextChangeZ);
+
+// The fastest kernel supported by the CPU.
+// Chosen on the first call.
+VoxelLeafMaskKernel voxelLeafMaskKernel();
+VoxelLeafMaskKernelUInt16 voxelLeafMaskKernelUInt16();
+
+// The name of the kernel returned by voxelLeafMaskKernel
+const char* voxelLeafMaskKernelName();
+
+// Scalar kernels. Supported everywhere.
+uint64_t sampleLeafMaskScalar(const float* entryDepths, const float* exitDepths,
+    size_t rowStride, int resolution, int z, int* nextChangeZ);
+uint64_t sampleLeafMaskUInt16Scalar(const uint16_t* entryDepths, const uint16_t* exitDepths,
+    size_t rowStride, int z, int* nextChangeZ);
+uint64_t sampleLeafMaskUInt32Scalar(const uint32_t* entryDepths, const uint32_t* exitDepths,
+    size_t rowStride, int z, int* nextChangeZ);
+
+#if defined(__SSE2__)
+// SSE2 and AVX2 kernels. AVX2 is checked for at runtime.
+uint64_t sampleLeafMaskSSE2(const float* entryDepths, const float* exitDepths,
+    size_t rowStride, int resolution, int z, int* nextChangeZ);
+uint64_t sampleLeafMaskAVX2(const float* entryDepths, const float* exitDepths,
+    size_t rowStride, int resolution, int z, int* nextChangeZ);
+uint64_t sampleLeafMaskUInt16AVX2(const uint16_t* entryDepths, const uint16_t* exitDepths,
+    size_t rowStride, int z, int* nextChangeZ);
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+// NEON kernel. Always available on ARM64.
+uint64_t sampleLeafMaskNEON(const float* entryDepths, const float* exitDepths,
+    size_t rowStride, int resolution, int z, int* nextChangeZ);
+#endif
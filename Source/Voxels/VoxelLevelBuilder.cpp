@@ -0,0 +1,418 @@
+#include "VoxelLevelBuilder.hpp"
+
+#include <assert.h>
+#include <algorithm>
+#include <climits>
+
+#include "JobSystem.hpp"
+#include "VoxelRadixSort.hpp"
+
+// The writer takes at most this many leaves at once
+const int LeafBatchSize = 64;
+
+// The number of expanded children in a child mask
+static inline int expandedChildCount(uint16_t childMask)
+{
+    // Mixed children have the high bit of their 2 bits set
+    return __builtin_popcount(childMask & 0xAAAA);
+}
+
+// Sorts the pairs by key and finds the first pair of each run of
+// equal keys. The end of the last run is added at the end.
+static vector<uint32_t> sortUniqueKeys(VoxelSortPair* pairs, size_t count)
+{
+    voxelRadixSort(pairs, count);
+
+    vector<uint32_t> runStarts;
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(i == 0 || pairs[i].key != pairs[i - 1].key)
+        {
+            runStarts.push_back((uint32_t)i);
+        }
+    }
+
+    runStarts.push_back((uint32_t)count);
+    return runStarts;
+}
+
+VoxelLevelBuilder::VoxelLevelBuilder(const VoxelDepthMap* depthMap, VoxelWriter* writer)
+    : depthMap_(depthMap),
+    writer_(writer),
+    rangeCount_(JobSystem::shared()->workerCount() * 4)
+{
+    // Positions are stored in 16 bits
+    assert(depthMap->resolution() / 8 <= 65536);
+}
+
+VoxelPointer VoxelLevelBuilder::build()
+{
+    // The root node covers the whole tile
+    VoxelLevelNode root;
+    root.x = 0;
+    root.y = 0;
+    root.z = 0;
+    root.childMask = 0;
+    root.firstChild = 0;
+    levels_.push_back(vector<VoxelLevelNode>(1, root));
+
+    // Sample the child masks from the root down to the 8x8x8 nodes
+    int level = 0;
+    while((depthMap_->resolution() >> level) > 8)
+    {
+        size_t childCount = sampleChildMasks(level);
+        expandLevel(level, childCount);
+        level ++;
+    }
+
+    leafMasks_.resize(sampleChildMasks(level));
+    sampleLeaves();
+
+    // Write the leaves
+    WrittenLevel children;
+    writeLeaves(&children);
+    vector<uint64_t>().swap(leafMasks_);
+
+    // Write the levels from the bottom up.
+    // Each level only needs the level below.
+    WrittenLevel nodes;
+    for(; level >= 0; --level)
+    {
+        writeLevel(level, children, &nodes);
+        std::swap(children, nodes);
+
+        vector<VoxelLevelNode>().swap(levels_[level]);
+    }
+
+    levels_.clear();
+    return children.locations[0];
+}
+
+size_t VoxelLevelBuilder::sampleChildMasks(int level)
+{
+    vector<VoxelLevelNode> &nodes = levels_[level];
+    if(nodes.empty())
+    {
+        return 0;
+    }
+
+    // Sample the masks in parallel
+    JobSystem::shared()->parallelFor((int)nodes.size(), rangeCount_, [this, &nodes, level](int first, int last)
+    {
+        for(int i = first; i < last; ++i)
+        {
+            VoxelTile tile = getNodeTile(nodes[i], level);
+
+            // Get the child locations
+            VoxelTile children[8];
+            for(int child = 0; child < 8; ++child)
+            {
+                children[child] = tile;
+                if(tile.width == 8)
+                {
+                    // Leaves are 8x8x1 blocks in the same column
+                    children[child].z = tile.z + child;
+                    children[child].depth = 1;
+                }
+                else
+                {
+                    // The x,y,z are bits from the index
+                    children[child].width = tile.width / 2;
+                    children[child].depth = tile.depth / 2;
+                    children[child].x = tile.x + (child >> 2) * children[child].width;
+                    children[child].y = tile.y + ((child >> 1) & 1) * children[child].width;
+                    children[child].z = tile.z + (child & 1) * children[child].depth;
+                }
+            }
+
+            // Nodes are not reused down their columns, so the
+            // change distance is not needed.
+            int changeDistance;
+            nodes[i].childMask = depthMap_->sampleChildMask(children, &changeDistance);
+        }
+    });
+
+    // The children of each node follow the children of the nodes before it
+    size_t childCount = 0;
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        nodes[i].firstChild = (uint32_t)childCount;
+        childCount += expandedChildCount(nodes[i].childMask);
+    }
+
+    assert(childCount <= UINT32_MAX);
+    return childCount;
+}
+
+void VoxelLevelBuilder::expandLevel(int level, size_t childCount)
+{
+    // Adding the level may move the others
+    levels_.push_back(vector<VoxelLevelNode>(childCount));
+    const vector<VoxelLevelNode> &nodes = levels_[level];
+    vector<VoxelLevelNode> &children = levels_[level + 1];
+    if(nodes.empty())
+    {
+        return;
+    }
+
+    // Each node fills in its own children
+    JobSystem::shared()->parallelFor((int)nodes.size(), rangeCount_, [&nodes, &children](int first, int last)
+    {
+        for(int i = first; i < last; ++i)
+        {
+            const VoxelLevelNode &node = nodes[i];
+            uint32_t childIndex = node.firstChild;
+            for(int child = 0; child < 8; ++child)
+            {
+                if(((node.childMask >> (child * 2)) & 3) != VS_Mixed)
+                {
+                    continue;
+                }
+
+                // Children are half the width of their parent
+                VoxelLevelNode &childNode = children[childIndex++];
+                childNode.x = (uint16_t)(node.x * 2 + (child >> 2));
+                childNode.y = (uint16_t)(node.y * 2 + ((child >> 1) & 1));
+                childNode.z = (uint16_t)(node.z * 2 + (child & 1));
+                childNode.childMask = 0;
+                childNode.firstChild = 0;
+            }
+        }
+    });
+}
+
+void VoxelLevelBuilder::sampleLeaves()
+{
+    const vector<VoxelLevelNode> &nodes = levels_.back();
+    if(nodes.empty())
+    {
+        return;
+    }
+
+    // Sort the 8x8x8 nodes by column, then by z
+    int columnWidth = depthMap_->resolution() / 8;
+    vector<VoxelSortPair> order(nodes.size());
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        uint64_t column = (uint64_t)nodes[i].y * columnWidth + nodes[i].x;
+        order[i].key = (column << 16) | nodes[i].z;
+        order[i].index = (uint32_t)i;
+    }
+
+    int columnBits = 1;
+    while(((uint64_t)1 << columnBits) < (uint64_t)columnWidth * columnWidth)
+    {
+        columnBits ++;
+    }
+
+    voxelRadixSort(order.data(), order.size(), columnBits + 16);
+
+    // Find where each column starts
+    vector<uint32_t> columnStarts;
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        if(i == 0 || (order[i].key >> 16) != (order[i - 1].key >> 16))
+        {
+            columnStarts.push_back((uint32_t)i);
+        }
+    }
+
+    columnStarts.push_back((uint32_t)order.size());
+
+    // The columns are independent, so are sampled in parallel
+    int columnCount = (int)columnStarts.size() - 1;
+    JobSystem::shared()->parallelFor(columnCount, rangeCount_, [this, &nodes, &order, &columnStarts](int first, int last)
+    {
+        for(int column = first; column < last; ++column)
+        {
+            // The leaf reused down the column.
+            // Sampled on first use.
+            int changeZ = 0;
+            uint64_t cachedMask = 0;
+
+            for(uint32_t i = columnStarts[column]; i < columnStarts[column + 1]; ++i)
+            {
+                const VoxelLevelNode &node = nodes[order[i].index];
+                uint32_t leafIndex = node.firstChild;
+                for(int child = 0; child < 8; ++child)
+                {
+                    if(((node.childMask >> (child * 2)) & 3) != VS_Mixed)
+                    {
+                        continue;
+                    }
+
+                    // Sample a new leaf once the cached leaf changes
+                    int z = node.z * 8 + child;
+                    if(z >= changeZ)
+                    {
+                        cachedMask = depthMap_->sampleLeafMask(node.x * 8, node.y * 8, z, &changeZ);
+                    }
+
+                    leafMasks_[leafIndex++] = cachedMask;
+                }
+            }
+        }
+    });
+}
+
+void VoxelLevelBuilder::writeLeaves(WrittenLevel* leaves)
+{
+    leaves->hashes.resize(leafMasks_.size());
+    leaves->mirrors.resize(leafMasks_.size());
+    leaves->locations.resize(leafMasks_.size());
+    if(leafMasks_.empty())
+    {
+        return;
+    }
+
+    // Group the leaves with the same smallest mirror.
+    // The mirrored masks are the hashes.
+    vector<VoxelSortPair> pairs(leafMasks_.size());
+    JobSystem::shared()->parallelFor((int)leafMasks_.size(), rangeCount_, [this, leaves, &pairs](int first, int last)
+    {
+        for(int i = first; i < last; ++i)
+        {
+            int mirror;
+            pairs[i].key = canonicalLeafMask(leafMasks_[i], &mirror);
+            pairs[i].index = (uint32_t)i;
+            leaves->hashes[i] = computeLeafMirrorHashes(leafMasks_[i]);
+            leaves->mirrors[i] = (uint8_t)mirror;
+        }
+    });
+
+    vector<uint32_t> runStarts = sortUniqueKeys(pairs.data(), pairs.size());
+
+    // Write each unique leaf once, in batches, and give its
+    // location to every leaf with the same mask.
+    int uniqueCount = (int)runStarts.size() - 1;
+    int batchCount = (uniqueCount + LeafBatchSize - 1) / LeafBatchSize;
+    JobSystem::shared()->parallelFor(batchCount, rangeCount_, [this, uniqueCount, &pairs, &runStarts, leaves](int first, int last)
+    {
+        for(int batch = first; batch < last; ++batch)
+        {
+            int firstUnique = batch * LeafBatchSize;
+            int batchSize = std::min(LeafBatchSize, uniqueCount - firstUnique);
+
+            VoxelLeafNode batchLeaves[LeafBatchSize];
+            for(int i = 0; i < batchSize; ++i)
+            {
+                batchLeaves[i].leafMask = pairs[runStarts[firstUnique + i]].key;
+            }
+
+            VoxelPointer leafLocations[LeafBatchSize];
+            writer_->writeLeaves(batchLeaves, batchSize, leafLocations);
+
+            for(int i = 0; i < batchSize; ++i)
+            {
+                for(uint32_t j = runStarts[firstUnique + i]; j < runStarts[firstUnique + i + 1]; ++j)
+                {
+                    leaves->locations[pairs[j].index] = leafLocations[i];
+                }
+            }
+        }
+    });
+}
+
+void VoxelLevelBuilder::writeLevel(int level, const WrittenLevel &children, WrittenLevel* written)
+{
+    const vector<VoxelLevelNode> &nodes = levels_[level];
+    written->hashes.resize(nodes.size());
+    written->mirrors.resize(nodes.size());
+    written->locations.resize(nodes.size());
+    if(nodes.empty())
+    {
+        return;
+    }
+
+    // The children of 8x8x8 nodes are leaves
+    bool leafChildren = (depthMap_->resolution() >> level) == 8;
+
+    // Hash the nodes the same way as the recursive build.
+    // The root pointer cannot hold a mirror, so the root is stored as it is.
+    vector<VoxelSortPair> pairs(nodes.size());
+    JobSystem::shared()->parallelFor((int)nodes.size(), rangeCount_, [&nodes, &children, written, &pairs, level, leafChildren](int first, int last)
+    {
+        for(int i = first; i < last; ++i)
+        {
+            const VoxelLevelNode &node = nodes[i];
+
+            // Non-expanded children use the child mask instead
+            VoxelMirrorHashes nodeChildHashes[8];
+            uint32_t childIndex = node.firstChild;
+            for(int child = 0; child < 8; ++child)
+            {
+                if(((node.childMask >> (child * 2)) & 3) == VS_Mixed)
+                {
+                    nodeChildHashes[child] = children.hashes[childIndex++];
+                }
+            }
+
+            computeMirrorHashes(node.childMask, leafChildren, nodeChildHashes, &written->hashes[i]);
+            int mirror = (level == 0) ? 0 : canonicalMirror(written->hashes[i]);
+            written->mirrors[i] = (uint8_t)mirror;
+            pairs[i].key = written->hashes[i].hashes[mirror];
+            pairs[i].index = (uint32_t)i;
+        }
+    });
+
+    // Group the nodes with the same stored node
+    vector<uint32_t> runStarts = sortUniqueKeys(pairs.data(), pairs.size());
+
+    // Write each unique node once and give its location to every copy
+    int uniqueCount = (int)runStarts.size() - 1;
+    JobSystem::shared()->parallelFor(uniqueCount, rangeCount_, [this, &nodes, &children, &pairs, &runStarts, written, level, leafChildren](int first, int last)
+    {
+        for(int unique = first; unique < last; ++unique)
+        {
+            uint32_t nodeIndex = pairs[runStarts[unique]].index;
+            const VoxelLevelNode &levelNode = nodes[nodeIndex];
+
+            VoxelInnerNode node;
+            node.paddingBits = 0;
+            node.childMask = levelNode.childMask;
+
+            uint32_t childIndex = levelNode.firstChild;
+            int expandedCount = 0;
+            for(int child = 0; child < 8; ++child)
+            {
+                if(node.isChildExpanded(child))
+                {
+                    node.childPositions[expandedCount++] = children.locations[childIndex];
+                    node.setChildMirror(child, children.mirrors[childIndex]);
+                    childIndex ++;
+                }
+            }
+
+            VoxelPointer location;
+            if(level == 0)
+            {
+                location = writer_->writeNode(node, expandedCount, pairs[runStarts[unique]].key);
+            }
+            else
+            {
+                int mirror;
+                location = writer_->writeCanonicalNode(node, expandedCount, leafChildren, written->hashes[nodeIndex], &mirror);
+                assert(mirror == written->mirrors[nodeIndex]);
+            }
+
+            for(uint32_t j = runStarts[unique]; j < runStarts[unique + 1]; ++j)
+            {
+                written->locations[pairs[j].index] = location;
+            }
+        }
+    });
+}
+
+VoxelTile VoxelLevelBuilder::getNodeTile(const VoxelLevelNode &node, int level) const
+{
+    // Each level halves the node width
+    int width = depthMap_->resolution() >> level;
+
+    VoxelTile tile;
+    tile.x = node.x * width;
+    tile.y = node.y * width;
+    tile.z = node.z * width;
+    tile.width = width;
+    tile.depth = width;
+    return tile;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "VoxelDepthMap.hpp"
+#include "VoxelNode.hpp"
+#include "VoxelWriter.hpp"
+
+using namespace std;
+
+// A node in one level of the tile being built.
+// The position is in units of the level's node width.
+struct VoxelLevelNode
+{
+    uint16_t x;
+    uint16_t y;
+    uint16_t z;
+    uint16_t childMask;
+
+    // The index of the first expanded child in the level below.
+    // The expanded children of a node are next to each other.
+    uint32_t firstChild;
+};
+
+// Builds the tree of a tile one level at a time.
+// The child masks of every level are sampled from the root down, then the
+// leaves are sampled. The nodes are then written from the leaves up. The
+// candidate nodes of each level are sorted by the hash of their stored
+// mirror image, so each unique node is written once and its location given
+// to every copy.
+// Writes the same nodes as the recursive build, in a different order.
+class VoxelLevelBuilder
+{
+public:
+    // The depth map and writer are not owned by the builder
+    VoxelLevelBuilder(const VoxelDepthMap* depthMap, VoxelWriter* writer);
+
+    // Builds the tree and returns the location of the root node
+    VoxelPointer build();
+
+private:
+    // The nodes of a level once they are written
+    struct WrittenLevel
+    {
+        // The hashes of each node's mirror images
+        vector<VoxelMirrorHashes> hashes;
+
+        // The mirror that gives back each node from its stored node
+        vector<uint8_t> mirrors;
+
+        // The location of each stored node
+        vector<VoxelPointer> locations;
+    };
+
+    const VoxelDepthMap* depthMap_;
+    VoxelWriter* writer_;
+
+    // The number of ranges work is split into
+    int rangeCount_;
+
+    // The nodes of each level, from the root down to the 8x8x8 nodes
+    vector<vector<VoxelLevelNode> > levels_;
+
+    // The leaf masks. The leaves of each 8x8x8 node are next to each other.
+    vector<uint64_t> leafMasks_;
+
+    // Samples the child masks of a level and finds the first child of
+    // each node. Returns the number of expanded children.
+    size_t sampleChildMasks(int level);
+
+    // Creates the level below from the expanded children of a level
+    void expandLevel(int level, size_t childCount);
+
+    // Samples the leaf masks of the 8x8x8 nodes. Each column is sampled
+    // in z order, reusing leaves until the depths say they change.
+    void sampleLeaves();
+
+    // Writes the unique leaves
+    void writeLeaves(WrittenLevel* leaves);
+
+    // Writes the unique nodes of a level. Takes the level below.
+    void writeLevel(int level, const WrittenLevel &children, WrittenLevel* nodes);
+
+    // Gets the tile covered by a node in a level
+    VoxelTile getNodeTile(const VoxelLevelNode &node, int level) const;
+};
@@ -1,6 +1,7 @@
 #include "VoxelNode.hpp"
 
 #include <assert.h>
+#include <memory.h>
 
 bool VoxelInnerNode::isChildExpanded(int index) const
 {
@@ -15,19 +16,282 @@ bool VoxelInnerNode::isChildExpanded(int index) const
     return (shadowing == VS_Mixed);
 }
 
-VoxelNodeHash computeInnerNodeHash(VoxelNodeHash* childHashes)
+void VoxelInnerNode::setChildMirror(int index, int mirror)
 {
-    VoxelNodeHash hash = 0;
+    assert(index >= 0 && index < 8);
+    assert(mirror >= 0 && mirror < VoxelMirrorCount);
     
-    // Add each child hash
+    paddingBits = (uint16_t)((paddingBits & ~(3 << (index * 2))) | (mirror << (index * 2)));
+}
+
+int encodeInnerNode(const VoxelInnerNode &node, int expandedChildCount, VoxelPointer location, uint32_t* words)
+{
+    assert(expandedChildCount >= 0 && expandedChildCount <= 8);
+    
+    // Children are written before their parents, so can
+    // usually be found a short distance back
+    bool useOffsets = (expandedChildCount > 0);
+    for(int i = 0; i < expandedChildCount && useOffsets; ++i)
+    {
+        useOffsets = (node.childPositions[i] < location) && (location - node.childPositions[i] <= 0xFFFF);
+    }
+    
+    if(!useOffsets)
+    {
+        memcpy(words, &node, (1 + expandedChildCount) * 4);
+        return 1 + expandedChildCount;
+    }
+    
+    // Mark every expanded child, so the offsets can be
+    // found from the state of any one of them
+    uint16_t childMask = node.childMask | ((node.childMask >> 1) & 0x5555);
+    words[0] = node.paddingBits | ((uint32_t)childMask << 16);
+    
+    // The first offset of each word is in the low bits
+    int wordCount = 1 + (expandedChildCount + 1) / 2;
+    memset(words + 1, 0, (wordCount - 1) * 4);
+    for(int i = 0; i < expandedChildCount; ++i)
+    {
+        words[1 + i / 2] |= (location - node.childPositions[i]) << ((i & 1) * 16);
+    }
+    
+    return wordCount;
+}
+
+VoxelPointer alignToSegment(VoxelPointer location, int wordCount)
+{
+    assert(wordCount > 0 && (uint32_t)wordCount <= VoxelSegmentAlignment);
+    
+    // Move to the start of the next segment if the node would cross it
+    VoxelPointer lastWord = location + wordCount - 1;
+    if(lastWord / VoxelSegmentAlignment != location / VoxelSegmentAlignment)
+    {
+        return lastWord - lastWord % VoxelSegmentAlignment;
+    }
+    
+    return location;
+}
+
+VoxelInnerNode decodeInnerNode(const uint32_t* tree, VoxelPointer location)
+{
+    VoxelInnerNode node;
+    node.paddingBits = (uint16_t)tree[location];
+    node.childMask = (uint16_t)(tree[location] >> 16);
+    
+    // Nodes stored with offsets have a child marked VS_MixedOffset
+    bool useOffsets = (node.childMask & (node.childMask >> 1) & 0x5555) != 0;
+    node.childMask &= ~((node.childMask >> 1) & 0x5555);
+    
+    // The high bit of each expanded child's state is set
+    int expandedChildCount = __builtin_popcount(node.childMask & 0xAAAA);
+    
+    for(int i = 0; i < expandedChildCount; ++i)
+    {
+        if(useOffsets)
+        {
+            node.childPositions[i] = location - ((tree[location + 1 + i / 2] >> ((i & 1) * 16)) & 0xFFFF);
+        }
+        else
+        {
+            node.childPositions[i] = tree[location + 1 + i];
+        }
+    }
+    
+    return node;
+}
+
+// The child that moves to an index when a node is mirrored.
+// Child index bit 2 is x and bit 1 is y.
+static inline int mirrorChildIndex(int index, bool leafChildren, int mirror)
+{
+    if(leafChildren)
+    {
+        return index;
+    }
+    
+    return index ^ ((mirror & 1) << 2) ^ (mirror & 2);
+}
+
+// Moves the 2 bit child states of a child mask
+static uint16_t mirrorChildMask(uint16_t childMask, bool leafChildren, int mirror)
+{
+    uint16_t mirrored = 0;
+    for(int i = 0; i < 8; ++i)
+    {
+        int source = mirrorChildIndex(i, leafChildren, mirror);
+        mirrored |= ((childMask >> (source * 2)) & 3) << (i * 2);
+    }
+    
+    return mirrored;
+}
+
+// Scrambles the bits of a hash (the splitmix64 finalizer)
+static VoxelNodeHash mixHash(VoxelNodeHash hash)
+{
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+VoxelNodeHash computeInnerNodeHash(uint16_t childMask, VoxelNodeHash* childHashes)
+{
+    // Start with the child mask. Leaf masks can take any value,
+    // so a node with leaf children could otherwise match a node
+    // whose children are not expanded.
+    VoxelNodeHash hash = mixHash(0x9e3779b97f4a7c15ULL ^ childMask);
+    
+    // Add each child hash.
+    // The hash is mixed after each child so that nodes with different
+    // children, or at different heights, are very unlikely to collide.
+    // The writer shares nodes with the same hash.
     for(int i = 0; i < 8; ++i)
     {
         // Get the child hash
         VoxelNodeHash childHash = childHashes[i];
-        
-        // Shift the hash and combine the child hash
-        hash = (hash >> 10) + (hash << 10) + childHash;
+    
+        // Combine the child hash
+        hash = mixHash(hash ^ childHash);
     }
     
     return hash;
 }
+
+// The children of 8x8x8 nodes do not move when mirrored, so can hold
+// the same words as bigger nodes that mirror differently. Each child is
+// hashed from all of its mirror images, so their parents differ.
+// The images are mixed first, so rotating them apart is enough.
+static inline VoxelNodeHash rotateHash(VoxelNodeHash hash, int bits)
+{
+    return (hash << bits) | (hash >> (64 - bits));
+}
+
+void computeMirrorHashes(uint16_t childMask, bool leafChildren,
+    const VoxelMirrorHashes* childHashes, VoxelMirrorHashes* hashes)
+{
+    // Mix the images of each expanded child once
+    VoxelMirrorHashes mixedChildHashes[8];
+    for(int i = 0; i < 8; ++i)
+    {
+        if(((childMask >> (i * 2)) & 3) == VS_Mixed)
+        {
+            for(int image = 0; image < VoxelMirrorCount; ++image)
+            {
+                mixedChildHashes[i].hashes[image] = mixHash(childHashes[i].hashes[image]);
+            }
+        }
+    }
+    
+    for(int mirror = 0; mirror < VoxelMirrorCount; ++mirror)
+    {
+        // Hash the mirrored node as if it was built directly.
+        // Each child is the mirror image of the child that moves there.
+        uint16_t mirroredMask = mirrorChildMask(childMask, leafChildren, mirror);
+        VoxelNodeHash mirroredChildHashes[8];
+        for(int i = 0; i < 8; ++i)
+        {
+            int source = mirrorChildIndex(i, leafChildren, mirror);
+            if(((childMask >> (source * 2)) & 3) == VS_Mixed)
+            {
+                const VoxelNodeHash* images = mixedChildHashes[source].hashes;
+                mirroredChildHashes[i] = images[mirror]
+                    ^ rotateHash(images[mirror ^ 1], 17)
+                    ^ rotateHash(images[mirror ^ 2], 31)
+                    ^ rotateHash(images[mirror ^ 3], 47);
+            }
+            else
+            {
+                mirroredChildHashes[i] = mirroredMask;
+            }
+        }
+    
+        hashes->hashes[mirror] = computeInnerNodeHash(mirroredMask, mirroredChildHashes);
+    }
+}
+
+int canonicalMirror(const VoxelMirrorHashes &hashes)
+{
+    int mirror = 0;
+    for(int i = 1; i < VoxelMirrorCount; ++i)
+    {
+        if(hashes.hashes[i] < hashes.hashes[mirror])
+        {
+            mirror = i;
+        }
+    }
+    
+    return mirror;
+}
+
+VoxelInnerNode mirrorInnerNode(const VoxelInnerNode &node, bool leafChildren, int mirror)
+{
+    // Find the pointer of each expanded child
+    VoxelPointer childPointers[8];
+    int visitedChildren = 0;
+    for(int i = 0; i < 8; ++i)
+    {
+        if(node.isChildExpanded(i))
+        {
+            childPointers[i] = node.childPositions[visitedChildren++];
+        }
+    }
+    
+    VoxelInnerNode mirrored;
+    mirrored.paddingBits = 0;
+    mirrored.childMask = mirrorChildMask(node.childMask, leafChildren, mirror);
+    
+    // The stored children stay the same. Their mirror
+    // combines with the mirror of the node.
+    visitedChildren = 0;
+    for(int i = 0; i < 8; ++i)
+    {
+        if(mirrored.isChildExpanded(i))
+        {
+            int source = mirrorChildIndex(i, leafChildren, mirror);
+            mirrored.childPositions[visitedChildren++] = childPointers[source];
+            mirrored.setChildMirror(i, node.childMirror(source) ^ mirror);
+        }
+    }
+    
+    return mirrored;
+}
+
+uint64_t mirrorLeafMask(uint64_t leafMask, int mirror)
+{
+    // Bit (x * 8 + y) holds voxel (x, y), so each byte is a row of y
+    if(mirror & 1)
+    {
+        // Reverse the order of the rows
+        leafMask = __builtin_bswap64(leafMask);
+    }
+    
+    if(mirror & 2)
+    {
+        // Reverse the bits in each row
+        leafMask = ((leafMask >> 1) & 0x5555555555555555ULL) | ((leafMask & 0x5555555555555555ULL) << 1);
+        leafMask = ((leafMask >> 2) & 0x3333333333333333ULL) | ((leafMask & 0x3333333333333333ULL) << 2);
+        leafMask = ((leafMask >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((leafMask & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    }
+    
+    return leafMask;
+}
+
+VoxelMirrorHashes computeLeafMirrorHashes(uint64_t leafMask)
+{
+    VoxelMirrorHashes hashes;
+    for(int mirror = 0; mirror < VoxelMirrorCount; ++mirror)
+    {
+        hashes.hashes[mirror] = mirrorLeafMask(leafMask, mirror);
+    }
+    
+    return hashes;
+}
+
+uint64_t canonicalLeafMask(uint64_t leafMask, int* mirror)
+{
+    VoxelMirrorHashes hashes = computeLeafMirrorHashes(leafMask);
+    *mirror = canonicalMirror(hashes);
+    return hashes.hashes[*mirror];
+}
@@ -8,6 +8,25 @@ typedef uint32_t VoxelPointer;
 // Use 64-bit hashes
 typedef uint64_t VoxelNodeHash;
 
+// The tree is split into segments for the GPU, each read through its own
+// buffer texture. Nodes never cross a multiple of this many words, so
+// any power of two segment size from it upwards can be used.
+const uint32_t VoxelSegmentAlignment = 1 << 20;
+
+// Leaf nodes cover an 8x8 block of voxel columns
+const int VoxelLeafWidth = 8;
+
+// Nodes are stored once for all of their XY mirror images.
+// Bit 0 of a mirror flips x and bit 1 flips y. Each mirror
+// undoes itself, and two mirrors combine with xor.
+const int VoxelMirrorCount = 4;
+
+// The hashes of the mirror images of a node
+struct VoxelMirrorHashes
+{
+    VoxelNodeHash hashes[VoxelMirrorCount];
+};
+
 // Subsection of the voxel structure
 struct VoxelTile
 {
@@ -26,13 +45,17 @@ enum VoxelShadowing : int
     VS_Shadowed = 0,
     VS_Unshadowed = 1,
     VS_Mixed = 2,
+    
+    // Mixed, in a stored node whose child pointers are 16 bit offsets
+    VS_MixedOffset = 3,
 };
 
 // Inner node.
 // May contain children.
 struct VoxelInnerNode
 {
-    // 16 bits padding
+    // The mirror applied to each stored child node to get the child.
+    // 2 bits per child.
     uint16_t paddingBits;
     
     // 2 bits per child
@@ -40,16 +63,53 @@ struct VoxelInnerNode
     
     // Variable length
     // 32 bits per child
+    // Stored nodes may use 16 bit offsets instead (see encodeInnerNode)
     VoxelPointer childPositions[8];
     
     // Returns true if the specified child index is expanded.
     bool isChildExpanded(int index) const;
+    
+    // The mirror of an expanded child
+    int childMirror(int index) const { return (paddingBits >> (index * 2)) & 3; }
+    void setChildMirror(int index, int mirror);
 };
 
-// Computes the hash of an inner node from the nodes of its children.
+// The most words an encoded inner node can use
+const int VoxelMaxInnerNodeWords = 9;
+
+// Encodes an inner node to be stored at the specified location.
+// If every child is less than 65536 words before the node, the child
+// pointers are stored as 16 bit offsets back from the node, two per word.
+// The expanded children of these nodes are marked VS_MixedOffset.
+// Otherwise the node is stored as it is. Returns the word count.
+int encodeInnerNode(const VoxelInnerNode &node, int expandedChildCount, VoxelPointer location, uint32_t* words);
+
+// The first location at or after the specified location
+// where a node of wordCount words does not cross a segment.
+VoxelPointer alignToSegment(VoxelPointer location, int wordCount);
+
+// Reads a stored inner node, as when rewriting a finished tree. The child
+// pointers are returned as word indexes and the children marked VS_Mixed.
+VoxelInnerNode decodeInnerNode(const uint32_t* tree, VoxelPointer location);
+
+// Computes the hash of an inner node from its child mask and the nodes of its children.
 // The childHashes array is size 8 regardless of the number of expanded child nodes.
 // Non-expanded child hashes are filled with the parent's childmask.
-VoxelNodeHash computeInnerNodeHash(VoxelNodeHash* childHashes);
+VoxelNodeHash computeInnerNodeHash(uint16_t childMask, VoxelNodeHash* childHashes);
+
+// Computes the hashes of each mirror image of an inner node.
+// childHashes holds the mirror hashes of the 8 children. Only the
+// expanded children are read. leafChildren is true for 8x8x8 nodes,
+// whose children are stacked in z, so do not move when mirrored.
+void computeMirrorHashes(uint16_t childMask, bool leafChildren,
+    const VoxelMirrorHashes* childHashes, VoxelMirrorHashes* hashes);
+
+// The mirror image of a node that is stored.
+// Chooses the image with the smallest hash.
+int canonicalMirror(const VoxelMirrorHashes &hashes);
+
+// Mirrors an inner node. The children move and their mirrors are updated.
+VoxelInnerNode mirrorInnerNode(const VoxelInnerNode &node, bool leafChildren, int mirror);
 
 // Leaf node.
 // Contains an 8x8 voxel plane.
@@ -59,3 +119,13 @@ struct VoxelLeafNode
     // 64 voxels = 64 bits
     uint64_t leafMask;
 };
+
+// Mirrors a leaf mask
+uint64_t mirrorLeafMask(uint64_t leafMask, int mirror);
+
+// The hashes of a leaf's mirror images, which are the mirrored masks
+VoxelMirrorHashes computeLeafMirrorHashes(uint64_t leafMask);
+
+// The mirror image of a leaf that is stored, which is the smallest
+// mirrored mask. Outputs the mirror that gives back the leaf.
+uint64_t canonicalLeafMask(uint64_t leafMask, int* mirror);
@@ -0,0 +1,105 @@
+#include "VoxelRadixSort.hpp"
+
+#include <assert.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <vector>
+
+#include "JobSystem.hpp"
+
+// Keys are sorted 8 bits at a time
+const int DigitBits = 8;
+const int DigitCount = 1 << DigitBits;
+
+// Small arrays are not worth splitting between jobs
+const size_t MinParallelCount = 16384;
+
+void voxelRadixSort(VoxelSortPair* pairs, size_t count, int keyBits)
+{
+    assert(count <= INT_MAX);
+    assert(keyBits > 0 && keyBits <= 64);
+    if(count < 2)
+    {
+        return;
+    }
+
+    // Each range of pairs has its own digit counts. The ranges match
+    // the ranges used by parallelFor, so a range finds its counts
+    // from its first index.
+    JobSystem* jobSystem = JobSystem::shared();
+    int rangeCount = (count < MinParallelCount) ? 1 : jobSystem->workerCount() * 4;
+    rangeCount = std::max(1, std::min(rangeCount, (int)count));
+    int rangeSize = ((int)count + rangeCount - 1) / rangeCount;
+
+    vector<size_t> digitOffsets((size_t)rangeCount * DigitCount);
+    VoxelSortPair* buffer = new VoxelSortPair[count];
+    VoxelSortPair* source = pairs;
+    VoxelSortPair* destination = buffer;
+
+    for(int shift = 0; shift < keyBits; shift += DigitBits)
+    {
+        // Count the digits in each range
+        std::fill(digitOffsets.begin(), digitOffsets.end(), 0);
+        jobSystem->parallelFor((int)count, rangeCount, [&](int first, int last)
+        {
+            size_t* counts = &digitOffsets[(size_t)(first / rangeSize) * DigitCount];
+            for(int i = first; i < last; ++i)
+            {
+                counts[(source[i].key >> shift) & (DigitCount - 1)] ++;
+            }
+        });
+
+        // Skip the pass if every key has the same digit
+        bool sorted = false;
+        for(int digit = 0; digit < DigitCount && !sorted; ++digit)
+        {
+            size_t digitTotal = 0;
+            for(int range = 0; range < rangeCount; ++range)
+            {
+                digitTotal += digitOffsets[(size_t)range * DigitCount + digit];
+            }
+
+            sorted = (digitTotal == count);
+        }
+
+        if(sorted)
+        {
+            continue;
+        }
+
+        // Turn the counts into offsets. Each digit's pairs are placed
+        // in range order, which keeps the sort stable.
+        size_t offset = 0;
+        for(int digit = 0; digit < DigitCount; ++digit)
+        {
+            for(int range = 0; range < rangeCount; ++range)
+            {
+                size_t* digitOffset = &digitOffsets[(size_t)range * DigitCount + digit];
+                size_t digitCount = *digitOffset;
+                *digitOffset = offset;
+                offset += digitCount;
+            }
+        }
+
+        // Move each pair to its place
+        jobSystem->parallelFor((int)count, rangeCount, [&](int first, int last)
+        {
+            size_t* offsets = &digitOffsets[(size_t)(first / rangeSize) * DigitCount];
+            for(int i = first; i < last; ++i)
+            {
+                destination[offsets[(source[i].key >> shift) & (DigitCount - 1)] ++] = source[i];
+            }
+        });
+
+        std::swap(source, destination);
+    }
+
+    // An odd number of passes leaves the pairs in the buffer
+    if(source != pairs)
+    {
+        std::memcpy(pairs, source, count * sizeof(VoxelSortPair));
+    }
+
+    delete[] buffer;
+}
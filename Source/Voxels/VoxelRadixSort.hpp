@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// A sort key and the index of the item it belongs to
+struct VoxelSortPair
+{
+    uint64_t key;
+    uint32_t index;
+};
+
+// Sorts pairs by key with a parallel LSD radix sort.
+// The sort is stable, so pairs with equal keys keep their order.
+// Only the low keyBits bits of each key are sorted on. Passes where
+// every key has the same digit are skipped.
+void voxelRadixSort(VoxelSortPair* pairs, size_t count, int keyBits = 64);
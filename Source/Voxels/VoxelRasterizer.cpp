@@ -0,0 +1,266 @@
+#include "VoxelRasterizer.hpp"
+
+#include <assert.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include "JobSystem.hpp"
+
+VoxelRasterizer::VoxelRasterizer(const Scene* scene, const Bounds &sceneBoundsLightSpace, int gridSubdivisions)
+    : sceneBounds_(sceneBoundsLightSpace),
+    triangles_(),
+    gridSubdivisions_(gridSubdivisions),
+    gridCells_()
+{
+    assert(gridSubdivisions_ > 0);
+
+    gatherTriangles(scene);
+    buildGrid();
+}
+
+void VoxelRasterizer::render(const Bounds &bounds, int resolution, float* entryDepths, float* exitDepths) const
+{
+    assert(resolution > 0 && resolution % VoxelLeafWidth == 0);
+
+    // Only consider triangles that can overlap the bounds
+    vector<int> triangles;
+    findTriangles(bounds, triangles);
+
+    // Split the rows of blocks into a few bands per worker so idle
+    // workers can steal bands from busy ones.
+    JobSystem* jobSystem = JobSystem::shared();
+    int blockRows = resolution / VoxelLeafWidth;
+    jobSystem->parallelFor(blockRows, jobSystem->workerCount() * 4, [&](int firstBlockRow, int lastBlockRow)
+    {
+        renderRows(bounds, resolution, triangles, firstBlockRow * VoxelLeafWidth, lastBlockRow * VoxelLeafWidth,
+            entryDepths, exitDepths);
+    });
+}
+
+bool VoxelRasterizer::overlapsTriangles(const Bounds &bounds) const
+{
+    vector<int> triangles;
+    findTriangles(bounds, triangles);
+
+    // The grid cells can be larger than the bounds,
+    // so check the bounds of each triangle
+    for(int index : triangles)
+    {
+        const VoxelRasterTriangle &triangle = triangles_[index];
+        if(triangle.minX <= bounds.max().x && triangle.maxX >= bounds.min().x
+            && triangle.minY <= bounds.max().y && triangle.maxY >= bounds.min().y)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void VoxelRasterizer::gatherTriangles(const Scene* scene)
+{
+    // Get the world to light space transformation matrix (without translation)
+    Matrix4x4 worldToLight = scene->mainLight()->worldToLocal();
+    worldToLight.set(0, 3, 0.0);
+    worldToLight.set(1, 3, 0.0);
+    worldToLight.set(2, 3, 0.0);
+
+    const vector<MeshInstance*>* instances = scene->meshInstances();
+    for(unsigned int i = 0; i < instances->size(); ++i)
+    {
+        // Get the mesh instance
+        MeshInstance* instance = (*instances)[i];
+
+        // Only static objects are stored in the voxel tree
+        if(instance->isStatic() == false)
+        {
+            continue;
+        }
+
+        // Get the model to light transformation
+        Matrix4x4 modelToLight = worldToLight * instance->localToWorld();
+
+        Mesh* mesh = instance->mesh();
+        const Vector3* vertices = mesh->vertices();
+        const MeshElementIndex* elements = mesh->elements();
+        for(int e = 0; e + 2 < mesh->elementsCount(); e += 3)
+        {
+            // Convert each vertex to light space
+            VoxelRasterTriangle triangle;
+            triangle.a = (modelToLight * Vector4(vertices[elements[e]], 1.0)).vec3();
+            triangle.b = (modelToLight * Vector4(vertices[elements[e + 1]], 1.0)).vec3();
+            triangle.c = (modelToLight * Vector4(vertices[elements[e + 2]], 1.0)).vec3();
+
+            // Store the xy bounds for binning
+            triangle.minX = std::min(triangle.a.x, std::min(triangle.b.x, triangle.c.x));
+            triangle.minY = std::min(triangle.a.y, std::min(triangle.b.y, triangle.c.y));
+            triangle.maxX = std::max(triangle.a.x, std::max(triangle.b.x, triangle.c.x));
+            triangle.maxY = std::max(triangle.a.y, std::max(triangle.b.y, triangle.c.y));
+
+            triangles_.push_back(triangle);
+        }
+    }
+}
+
+void VoxelRasterizer::buildGrid()
+{
+    gridCells_.resize(gridSubdivisions_ * gridSubdivisions_);
+
+    // Compute the light space size of each cell
+    Vector3 sceneMin = sceneBounds_.min();
+    float cellSizeX = sceneBounds_.size().x / gridSubdivisions_;
+    float cellSizeY = sceneBounds_.size().y / gridSubdivisions_;
+
+    for(unsigned int i = 0; i < triangles_.size(); ++i)
+    {
+        const VoxelRasterTriangle &triangle = triangles_[i];
+
+        // Find the range of cells covered by the triangle bounds
+        int minCellX = std::max(0, (int)floor((triangle.minX - sceneMin.x) / cellSizeX));
+        int minCellY = std::max(0, (int)floor((triangle.minY - sceneMin.y) / cellSizeY));
+        int maxCellX = std::min(gridSubdivisions_ - 1, (int)floor((triangle.maxX - sceneMin.x) / cellSizeX));
+        int maxCellY = std::min(gridSubdivisions_ - 1, (int)floor((triangle.maxY - sceneMin.y) / cellSizeY));
+
+        // Add to each cell
+        for(int x = minCellX; x <= maxCellX; ++x)
+        {
+            for(int y = minCellY; y <= maxCellY; ++y)
+            {
+                gridCells_[x * gridSubdivisions_ + y].push_back(i);
+            }
+        }
+    }
+}
+
+void VoxelRasterizer::findTriangles(const Bounds &bounds, vector<int> &triangles) const
+{
+    // Compute the light space size of each cell
+    Vector3 sceneMin = sceneBounds_.min();
+    float cellSizeX = sceneBounds_.size().x / gridSubdivisions_;
+    float cellSizeY = sceneBounds_.size().y / gridSubdivisions_;
+
+    // Find the range of cells covered by the bounds
+    int minCellX = std::max(0, (int)floor((bounds.min().x - sceneMin.x) / cellSizeX));
+    int minCellY = std::max(0, (int)floor((bounds.min().y - sceneMin.y) / cellSizeY));
+    int maxCellX = std::min(gridSubdivisions_ - 1, (int)floor((bounds.max().x - sceneMin.x) / cellSizeX));
+    int maxCellY = std::min(gridSubdivisions_ - 1, (int)floor((bounds.max().y - sceneMin.y) / cellSizeY));
+
+    // Gather the triangles from each cell
+    for(int x = minCellX; x <= maxCellX; ++x)
+    {
+        for(int y = minCellY; y <= maxCellY; ++y)
+        {
+            const vector<int> &cell = gridCells_[x * gridSubdivisions_ + y];
+            triangles.insert(triangles.end(), cell.begin(), cell.end());
+        }
+    }
+
+    // Triangles spanning several cells are only rendered once
+    std::sort(triangles.begin(), triangles.end());
+    triangles.erase(std::unique(triangles.begin(), triangles.end()), triangles.end());
+}
+
+void VoxelRasterizer::renderRows(const Bounds &bounds, int resolution, const vector<int> &triangles,
+    int firstRow, int lastRow, float* entryDepths, float* exitDepths) const
+{
+    // Clear the rows to the far plane.
+    // Whole rows of blocks are contiguous.
+    assert(firstRow % VoxelLeafWidth == 0 && lastRow % VoxelLeafWidth == 0);
+    size_t firstIndex = (size_t)firstRow * resolution;
+    size_t lastIndex = (size_t)lastRow * resolution;
+    std::fill(entryDepths + firstIndex, entryDepths + lastIndex, 1.0f);
+    std::fill(exitDepths + firstIndex, exitDepths + lastIndex, 1.0f);
+
+    // Draw each triangle
+    for(unsigned int i = 0; i < triangles.size(); ++i)
+    {
+        renderTriangle(triangles_[triangles[i]], bounds, resolution, firstRow, lastRow, entryDepths, exitDepths);
+    }
+}
+
+void VoxelRasterizer::renderTriangle(const VoxelRasterTriangle &triangle, const Bounds &bounds, int resolution,
+    int firstRow, int lastRow, float* entryDepths, float* exitDepths) const
+{
+    // Skip triangles outside of the bounds
+    if(triangle.maxX < bounds.min().x || triangle.minX > bounds.max().x
+       || triangle.maxY < bounds.min().y || triangle.minY > bounds.max().y)
+    {
+        return;
+    }
+
+    // Convert the vertices to pixel coordinates and [0-1] depth.
+    // This matches the orthographic shadow map projection.
+    Vector3 boundsMin = bounds.min();
+    Vector3 boundsSize = bounds.size();
+    double scaleX = resolution / (double)boundsSize.x;
+    double scaleY = resolution / (double)boundsSize.y;
+    double scaleZ = 1.0 / (double)boundsSize.z;
+
+    double ax = (triangle.a.x - boundsMin.x) * scaleX;
+    double ay = (triangle.a.y - boundsMin.y) * scaleY;
+    double az = (triangle.a.z - boundsMin.z) * scaleZ;
+    double bx = (triangle.b.x - boundsMin.x) * scaleX;
+    double by = (triangle.b.y - boundsMin.y) * scaleY;
+    double bz = (triangle.b.z - boundsMin.z) * scaleZ;
+    double cx = (triangle.c.x - boundsMin.x) * scaleX;
+    double cy = (triangle.c.y - boundsMin.y) * scaleY;
+    double cz = (triangle.c.z - boundsMin.z) * scaleZ;
+
+    // Twice the signed area. Counter clockwise triangles are front faces.
+    double area = (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+    if(area == 0.0)
+    {
+        return;
+    }
+
+    // Front faces give the entry depth, back faces the exit depth
+    float* depths = (area > 0.0) ? entryDepths : exitDepths;
+
+    // Find the pixels with centres that may be covered
+    int minX = std::max(0, (int)ceil(std::min(ax, std::min(bx, cx)) - 0.5));
+    int maxX = std::min(resolution - 1, (int)floor(std::max(ax, std::max(bx, cx)) - 0.5));
+    int minY = std::max(firstRow, (int)ceil(std::min(ay, std::min(by, cy)) - 0.5));
+    int maxY = std::min(lastRow - 1, (int)floor(std::max(ay, std::max(by, cy)) - 0.5));
+
+    // Edge functions, normalized so they give barycentric coordinates.
+    // The weight of each vertex is the edge function of the opposite edge.
+    double invArea = 1.0 / area;
+    double w0StepX = -(cy - by) * invArea;
+    double w1StepX = -(ay - cy) * invArea;
+    double w2StepX = -(by - ay) * invArea;
+
+    for(int y = minY; y <= maxY; ++y)
+    {
+        // Sample at pixel centres
+        double px = minX + 0.5;
+        double py = y + 0.5;
+
+        // Weights at the first pixel in the row
+        double w0 = ((cx - bx) * (py - by) - (cy - by) * (px - bx)) * invArea;
+        double w1 = ((ax - cx) * (py - cy) - (ay - cy) * (px - cx)) * invArea;
+        double w2 = ((bx - ax) * (py - ay) - (by - ay) * (px - ax)) * invArea;
+
+        // The start of the row in the first block of the row
+        float* row = depths + (size_t)(y / VoxelLeafWidth) * VoxelLeafWidth * resolution + (y % VoxelLeafWidth) * VoxelLeafWidth;
+        for(int x = minX; x <= maxX; ++x)
+        {
+            // Inside the triangle if all weights are positive
+            if(w0 >= 0.0 && w1 >= 0.0 && w2 >= 0.0)
+            {
+                // Depth is linear in an orthographic projection.
+                // Fragments outside the near and far planes are clipped.
+                float depth = (float)(w0 * az + w1 * bz + w2 * cz);
+                float* pixel = &row[(x / VoxelLeafWidth) * VoxelLeafWidth * VoxelLeafWidth + x % VoxelLeafWidth];
+                if(depth >= 0.0f && depth <= 1.0f && depth < *pixel)
+                {
+                    *pixel = depth;
+                }
+            }
+
+            w0 += w0StepX;
+            w1 += w1StepX;
+            w2 += w2StepX;
+        }
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+
+using namespace std;
+
+#include "Scene.hpp"
+#include "Bounds.hpp"
+#include "Vector3.hpp"
+#include "VoxelNode.hpp"
+
+// A static scene triangle in light space
+struct VoxelRasterTriangle
+{
+    Vector3 a;
+    Vector3 b;
+    Vector3 c;
+
+    // Light space xy bounds of the triangle
+    float minX, minY;
+    float maxX, maxY;
+};
+
+// Renders dual shadow maps of the static scene on the CPU.
+// Produces the same depths as a single cascade shadow map covering
+// the bounds, without needing an OpenGL context.
+class VoxelRasterizer
+{
+public:
+    VoxelRasterizer(const Scene* scene, const Bounds &sceneBoundsLightSpace, int gridSubdivisions);
+
+    // The number of static triangles in the scene
+    int triangleCount() const { return (int)triangles_.size(); }
+
+    // Renders the entry (front face) and exit (back face) depths of the region
+    // covered by the light space bounds. Depths are in the [0-1] range, with 1
+    // used where there is no geometry. The rows are split into jobs.
+    // The depths are written in blocks of one leaf column, in the order
+    // the tree reads them. The blocks and the depths in each block are row major.
+    void render(const Bounds &bounds, int resolution, float* entryDepths, float* exitDepths) const;
+
+    // True if any triangle may cover part of the light space bounds.
+    // Regions without triangles render as the far plane everywhere.
+    bool overlapsTriangles(const Bounds &bounds) const;
+
+private:
+    Bounds sceneBounds_;
+
+    // Static triangles in light space
+    vector<VoxelRasterTriangle> triangles_;
+
+    // A grid over the scene bounds in x and y.
+    // Each cell lists the triangles that overlap it.
+    int gridSubdivisions_;
+    vector<vector<int> > gridCells_;
+
+    // Converts the static mesh instances into light space triangles
+    void gatherTriangles(const Scene* scene);
+
+    // Adds each triangle to the grid cells it overlaps
+    void buildGrid();
+
+    // Finds the triangles that may overlap the light space bounds
+    void findTriangles(const Bounds &bounds, vector<int> &triangles) const;
+
+    // Renders the triangles into rows [firstRow, lastRow).
+    // The rows must be whole rows of blocks.
+    void renderRows(const Bounds &bounds, int resolution, const vector<int> &triangles,
+        int firstRow, int lastRow, float* entryDepths, float* exitDepths) const;
+
+    // Renders a single triangle into rows [firstRow, lastRow)
+    void renderTriangle(const VoxelRasterTriangle &triangle, const Bounds &bounds, int resolution,
+        int firstRow, int lastRow, float* entryDepths, float* exitDepths) const;
+};
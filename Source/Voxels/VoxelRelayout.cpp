@@ -0,0 +1,202 @@
+#include "VoxelRelayout.hpp"
+
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+
+VoxelRelayout::VoxelRelayout(const uint32_t* tree, size_t treeSizeWords, int rootCount, int tileResolution)
+    : tree_(tree),
+    treeSizeWords_(treeSizeWords),
+    rootCount_(rootCount),
+    treeHeight_((int)log2(tileResolution) - 1),
+    words_(NULL)
+{
+    // The bottom level holds the leaves
+    assert(treeHeight_ > 1);
+}
+
+VoxelLayoutStats VoxelRelayout::relayout(vector<uint32_t>* words)
+{
+    VoxelLayoutStats stats;
+    stats.sizeWordsBefore = treeSizeWords_;
+    stats.pointerDistanceBefore = pointerDistances(tree_);
+
+    // The root pointers come first
+    words_ = words;
+    words_->assign(rootCount_, 0);
+    words_->reserve(treeSizeWords_);
+    newLocations_.assign(treeSizeWords_, (VoxelPointer)Unplaced);
+
+    // Place each tile, then point at its new root
+    for(int tile : tileOrder())
+    {
+        placeSubtree(tree_[tile], treeHeight_, treeHeight_);
+        (*words_)[tile] = newLocations_[tree_[tile]];
+    }
+
+    stats.sizeWordsAfter = words_->size();
+    stats.pointerDistanceAfter = pointerDistances(words_->data());
+
+    // Free the memory used to place the nodes
+    vector<VoxelPointer>().swap(newLocations_);
+    words_ = NULL;
+
+    return stats;
+}
+
+void VoxelRelayout::placeSubtree(VoxelPointer node, int height, int levels)
+{
+    assert(node < treeSizeWords_);
+
+    // Every descendant of a placed node is placed
+    if(newLocations_[node] != Unplaced)
+    {
+        return;
+    }
+
+    if(levels == 1)
+    {
+        placeNode(node, height);
+        return;
+    }
+
+    // Place the bottom subtrees, then the top subtree above them
+    int topLevels = levels / 2;
+    vector<VoxelPointer> bottomRoots;
+    findDescendants(node, topLevels, &bottomRoots);
+    for(VoxelPointer bottomRoot : bottomRoots)
+    {
+        placeSubtree(bottomRoot, height - topLevels, levels - topLevels);
+    }
+
+    placeSubtree(node, height, topLevels);
+}
+
+void VoxelRelayout::placeNode(VoxelPointer node, int height)
+{
+    // Leaves are copied as they are
+    if(height == 1)
+    {
+        newLocations_[node] = alignWords(2);
+        words_->push_back(tree_[node]);
+        words_->push_back(tree_[node + 1]);
+        return;
+    }
+
+    // Point the inner node at the new children
+    VoxelInnerNode innerNode = decodeInnerNode(tree_, node);
+    int expandedChildCount = __builtin_popcount(innerNode.childMask & 0xAAAA);
+    for(int i = 0; i < expandedChildCount; ++i)
+    {
+        innerNode.childPositions[i] = newLocations_[innerNode.childPositions[i]];
+        assert(innerNode.childPositions[i] != Unplaced);
+    }
+
+    // Nodes that would cross a segment start the next one
+    uint32_t encoded[VoxelMaxInnerNodeWords];
+    VoxelPointer location = (VoxelPointer)words_->size();
+    int wordCount = encodeInnerNode(innerNode, expandedChildCount, location, encoded);
+    if(alignToSegment(location, wordCount) != location)
+    {
+        location = alignWords(VoxelMaxInnerNodeWords);
+        wordCount = encodeInnerNode(innerNode, expandedChildCount, location, encoded);
+    }
+
+    newLocations_[node] = location;
+    words_->insert(words_->end(), encoded, encoded + wordCount);
+}
+
+VoxelPointer VoxelRelayout::alignWords(int wordCount)
+{
+    // Fill the rest of the segment
+    VoxelPointer location = alignToSegment((VoxelPointer)words_->size(), wordCount);
+    words_->resize(location, 0);
+    return location;
+}
+
+void VoxelRelayout::findDescendants(VoxelPointer node, int levels, vector<VoxelPointer>* descendants) const
+{
+    if(newLocations_[node] != Unplaced)
+    {
+        return;
+    }
+
+    if(levels == 0)
+    {
+        descendants->push_back(node);
+        return;
+    }
+
+    VoxelInnerNode innerNode = decodeInnerNode(tree_, node);
+    int expandedChildCount = __builtin_popcount(innerNode.childMask & 0xAAAA);
+    for(int i = 0; i < expandedChildCount; ++i)
+    {
+        findDescendants(innerNode.childPositions[i], levels - 1, descendants);
+    }
+}
+
+vector<double> VoxelRelayout::pointerDistances(const uint32_t* tree) const
+{
+    vector<double> distances;
+
+    // The distinct nodes at the current depth
+    vector<VoxelPointer> nodes(tree, tree + rootCount_);
+    for(int height = treeHeight_; height > 1; --height)
+    {
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+
+        // Add up the distances to the children, which make up the next depth
+        vector<VoxelPointer> children;
+        double distanceSum = 0.0;
+        for(VoxelPointer node : nodes)
+        {
+            VoxelInnerNode innerNode = decodeInnerNode(tree, node);
+            int expandedChildCount = __builtin_popcount(innerNode.childMask & 0xAAAA);
+            for(int i = 0; i < expandedChildCount; ++i)
+            {
+                VoxelPointer child = innerNode.childPositions[i];
+                distanceSum += (child > node) ? (child - node) : (node - child);
+                children.push_back(child);
+            }
+        }
+
+        distances.push_back(children.empty() ? 0.0 : distanceSum / children.size());
+        nodes.swap(children);
+    }
+
+    return distances;
+}
+
+vector<int> VoxelRelayout::tileOrder() const
+{
+    // Tile (x, y) has root pointer x * subdivisions + y
+    int subdivisions = (int)sqrt((double)rootCount_);
+    assert(subdivisions * subdivisions == rootCount_);
+
+    // Interleave the x and y bits
+    vector<pair<uint32_t, int> > mortonCodes;
+    for(int tile = 0; tile < rootCount_; ++tile)
+    {
+        uint32_t x = tile / subdivisions;
+        uint32_t y = tile % subdivisions;
+        uint32_t code = 0;
+        for(int bit = 0; bit < 16; ++bit)
+        {
+            code |= ((x >> bit) & 1) << (bit * 2 + 1);
+            code |= ((y >> bit) & 1) << (bit * 2);
+        }
+
+        mortonCodes.push_back(make_pair(code, tile));
+    }
+
+    std::sort(mortonCodes.begin(), mortonCodes.end());
+
+    vector<int> order;
+    for(const auto &code : mortonCodes)
+    {
+        order.push_back(code.second);
+    }
+
+    return order;
+}
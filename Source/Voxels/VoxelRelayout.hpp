@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "VoxelNode.hpp"
+
+using namespace std;
+
+// The result of reordering a tree
+struct VoxelLayoutStats
+{
+    // The tree size before and after. Moving children closer lets
+    // more of their pointers be stored as offsets.
+    size_t sizeWordsBefore;
+    size_t sizeWordsAfter;
+
+    // The average distance in words from each node to its children,
+    // for the nodes at each depth below the tile roots
+    vector<double> pointerDistanceBefore;
+    vector<double> pointerDistanceAfter;
+};
+
+// Reorders the nodes of a finished tree so that nodes used together are
+// stored together. The tiles are placed in Morton order, so neighbouring
+// tiles are near each other, and the nodes of each tile in a van Emde Boas
+// order. Each subtree is split in half by height. The bottom subtrees are
+// placed first, then the top subtree, each split again in the same way.
+// A path from a root to a leaf then crosses few cache lines and pages,
+// whatever their size.
+//
+// Children are placed before their parents, as they are when building,
+// so most child pointers fit in 16 bit offsets (see encodeInnerNode).
+// Nodes shared by several parents are placed where they are first used.
+class VoxelRelayout
+{
+public:
+    // The tree starts with rootCount root pointers, each pointing
+    // at a tile of the specified resolution. It must stay valid while
+    // the relayout is used.
+    VoxelRelayout(const uint32_t* tree, size_t treeSizeWords, int rootCount, int tileResolution);
+
+    // Writes the reordered tree, starting with its root pointers
+    VoxelLayoutStats relayout(vector<uint32_t>* words);
+
+private:
+    // Marks nodes that are not placed yet
+    const static VoxelPointer Unplaced = 0xFFFFFFFF;
+
+    const uint32_t* tree_;
+    size_t treeSizeWords_;
+    int rootCount_;
+    int treeHeight_;
+
+    // The new location of each placed node, by its old location
+    vector<VoxelPointer> newLocations_;
+
+    // The reordered tree being written
+    vector<uint32_t>* words_;
+
+    // Places the top levels of a subtree. The node is at the specified
+    // height, where the leaves are at height 1.
+    void placeSubtree(VoxelPointer node, int height, int levels);
+
+    // Places a node after the nodes already placed. Its children must
+    // already be placed.
+    void placeNode(VoxelPointer node, int height);
+
+    // Pads the tree so that a node of wordCount words placed next
+    // does not cross a segment. Returns its location.
+    VoxelPointer alignWords(int wordCount);
+
+    // Finds the descendants of a node a number of levels below it.
+    // Skips nodes that are already placed, along with their descendants.
+    void findDescendants(VoxelPointer node, int levels, vector<VoxelPointer>* descendants) const;
+
+    // The average distance from each node to its children at each depth
+    vector<double> pointerDistances(const uint32_t* tree) const;
+
+    // The order the tiles are placed in
+    vector<int> tileOrder() const;
+};
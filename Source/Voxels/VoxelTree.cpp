@@ -2,6 +2,11 @@
 
 #include <assert.h>
 #include <math.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 
 #include <QElapsedTimer>
 
@@ -11,14 +16,19 @@ VoxelTree::VoxelTree(UniformManager* uniformManager, const Scene* scene, int res
     sceneBoundsLightSpace_(computeSceneBoundsLightSpace()),
     buildTimer_(),
     pcfKernelSize_(9),
+    concurrentBuilds_(JobSystem::shared()->workerCount()),
+    depthFormat_(VoxelDepthFormat::Float),
+    buildMode_(VoxelBuildMode::Recursive),
     startedTiles_(0),
     mergedTiles_(0),
     uploadedTiles_(0),
+    reusedTiles_(0),
     treeResolution_(resolution),
-    shadowMap_(scene, uniformManager, 1, 4),
+    rasterizer_(NULL),
     voxelWriter_(),
-    activeTiles_(),
-    activeTilesMutex_()
+    treeFile_(NULL),
+    tileJobs_(),
+    rootPointersMutex_()
 {
     buildTimer_.start();
     
@@ -30,40 +40,121 @@ VoxelTree::VoxelTree(UniformManager* uniformManager, const Scene* scene, int res
         tileResolution_ *= 2;
     }
     
-    // Each tile must be at least 8x8 so that leaf masks can be used
-    // and no more than 16K (maximum texture resolution)
+    // Each tile must be at least 8x8 so that leaf masks can be used.
+    // Depths are rendered on the CPU, so there is no texture size limit.
     assert(tileResolution_ >= 8);
-    assert(tileResolution_ <= 16384);
     
-    // Set the correct shadow map resolution
-    shadowMap_.setCascades(1, tileResolution_);
+    worldToVoxels_ = computeWorldToVoxelsMatrix();
+    
+    // Gather the static scene triangles for rendering tile depths.
+    // The triangles are binned into a grid matching the tiles.
+    rasterizer_ = new VoxelRasterizer(scene_, sceneBoundsLightSpace_, tileSubdivisions());
     
     // Create the root pointers in the buffer
     voxelWriter_.reserveRootNodePointerSpace(totalTiles());
     
-    // Create the buffer to hold the tree
-    glGenBuffers(1, &buffer_);
-    glBindBuffer(GL_TEXTURE_BUFFER, buffer_);
-    glGenTextures(1, &bufferTexture_);
-    glBindTexture(GL_TEXTURE_BUFFER, bufferTexture_);
-    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, buffer_);
+    // Create the buffer to hold the tree.
+    // The build fails if the tree grows past what the shader can read.
+    createTreeBuffer();
+    if(!headless())
+    {
+        voxelWriter_.setMaxSizeWords(maxUploadWords());
+    }
     
     // Set the initial buffer values
     updateBuffers();
     
-    // Start the tile merging thread
-    mergingThread_ = thread(&VoxelTree::mergeTiles, this);
-    
-    // Add every tile to the list of tiles to build
+    // Add every tile to the queue of tiles to build
     for(int tile = 0; tile < totalTiles(); ++tile)
     {
-        notStartedTiles_.push_back(tile);
+        notStartedTiles_.push_back(make_pair(0.0f, tile));
     }
+    
+    keyNotStartedTiles();
+}
+
+VoxelTree::VoxelTree(UniformManager* uniformManager, const Scene* scene, VoxelTreeFile* treeFile)
+    : uniformManager_(uniformManager),
+    scene_(scene),
+    sceneBoundsLightSpace_(computeSceneBoundsLightSpace()),
+    buildTimer_(),
+    pcfKernelSize_(9),
+    concurrentBuilds_(1),
+    depthFormat_(VoxelDepthFormat::Float),
+    buildMode_(VoxelBuildMode::Recursive),
+    mergedTiles_(0),
+    reusedTiles_(0),
+    treeResolution_(treeFile->header()->treeResolution),
+    tileResolution_(treeFile->header()->tileResolution),
+    rasterizer_(NULL),
+    voxelWriter_(),
+    treeFile_(treeFile),
+    tileJobs_(),
+    rootPointersMutex_()
+{
+    buildTimer_.start();
+    
+    // Every tile is already built
+    startedTiles_ = totalTiles();
+    mergedTiles_ = totalTiles();
+    uploadedTiles_ = 0;
+    
+    // Use the transformation the tree was built with
+    memcpy(worldToVoxels_.elements, treeFile_->header()->worldToVoxels, sizeof(worldToVoxels_.elements));
+    
+    // Upload the mapped tree
+    createTreeBuffer();
+    updateBuffers();
+}
+
+VoxelTree::~VoxelTree()
+{
+    // Wait for the tiles that have been started.
+    // Loaded trees have no tile jobs.
+    JobSystem::shared()->wait(&tileJobs_);
+    
+    // Delete the tree buffer
+    if(!headless())
+    {
+        glDeleteTextures(VoxelsUniformBuffer::MaxTreeSegments, bufferTextures_);
+        glDeleteBuffers(VoxelsUniformBuffer::MaxTreeSegments, buffers_);
+    }
+    
+    delete rasterizer_;
+    delete treeFile_;
+}
+
+VoxelTree* VoxelTree::loadFromFile(UniformManager* uniformManager, const Scene* scene, const string &fileName)
+{
+    // Map the file
+    VoxelTreeFile* treeFile = new VoxelTreeFile();
+    if(!treeFile->open(fileName))
+    {
+        delete treeFile;
+        return NULL;
+    }
+    
+    VoxelTree* tree = new VoxelTree(uniformManager, scene, treeFile);
+    
+    // The tree is only valid for the light and static objects it was built with
+    const float* fileMatrix = treeFile->header()->worldToVoxels;
+    Matrix4x4 sceneMatrix = tree->computeWorldToVoxelsMatrix();
+    for(int i = 0; i < 16; ++i)
+    {
+        if(fabs(fileMatrix[i] - sceneMatrix.elements[i]) > 1e-3 * (1.0 + fabs(sceneMatrix.elements[i])))
+        {
+            printf("Warning: tree file %s was built for a different light or scene \n", fileName.c_str());
+            break;
+        }
+    }
+    
+    printf("Loaded %dK tree from %s \n", tree->resolution() / 1024, fileName.c_str());
+    return tree;
 }
 
 size_t VoxelTree::sizeBytes() const
 {
-    return voxelWriter_.dataSizeBytes();
+    return treeSizeWords() * 4;
 }
 
 size_t VoxelTree::sizeMB() const
@@ -93,19 +184,90 @@ void VoxelTree::setPCFFilterSize(int kernelSize)
     updateUniformBuffer();
 }
 
+void VoxelTree::setConcurrentBuilds(int concurrentBuilds)
+{
+    assert(concurrentBuilds > 0);
+    
+    concurrentBuilds_ = concurrentBuilds;
+}
+
+void VoxelTree::setQuantizedDepths(bool quantizedDepths)
+{
+    depthFormat_ = quantizedDepths ? VoxelDepthMap::quantizedFormat(tileResolution_) : VoxelDepthFormat::Float;
+}
+
+VoxelCompactionStats VoxelTree::compactLeaves(int maxLeafError)
+{
+    // Only a finished tree that was built here can be changed
+    assert(completedTiles() == totalTiles());
+    assert(treeFile_ == NULL);
+    
+    // Rewrite the tree into a separate writer, then copy it back
+    VoxelWriter compactedWriter;
+    VoxelCompactor compactor(treeData(), treeSizeWords(), totalTiles(), tileResolution_);
+    VoxelCompactionStats stats = compactor.compact(maxLeafError, &compactedWriter);
+    compactedWriter.releaseIndex();
+    voxelWriter_.copyFrom(compactedWriter);
+    
+    // Reupload the smaller tree
+    reuploadTreeBuffer();
+    
+    return stats;
+}
+
+VoxelLayoutStats VoxelTree::relayout()
+{
+    // Only a finished tree that was built here can be changed
+    assert(completedTiles() == totalTiles());
+    assert(treeFile_ == NULL);
+    
+    // Reorder the tree into a separate buffer, then copy it back
+    vector<uint32_t> words;
+    VoxelRelayout relayout(treeData(), treeSizeWords(), totalTiles(), tileResolution_);
+    VoxelLayoutStats stats = relayout.relayout(&words);
+    voxelWriter_.copyFrom(words.data(), words.size());
+    
+    // Reupload the reordered tree
+    reuploadTreeBuffer();
+    
+    return stats;
+}
+
+bool VoxelTree::saveToFile(const string &fileName) const
+{
+    // Unbuilt tiles have no root node
+    if(completedTiles() < totalTiles())
+    {
+        printf("The tree must be finished before it is saved \n");
+        return false;
+    }
+    
+    // Describe the tree
+    VoxelTreeFileHeader header;
+    memset(&header, 0, sizeof(VoxelTreeFileHeader));
+    header.treeHeight = log2(tileResolution_);
+    header.tileSubdivisions = tileSubdivisions();
+    header.treeResolution = treeResolution_;
+    header.tileResolution = tileResolution_;
+    header.dataSizeWords = treeSizeWords();
+    memcpy(header.worldToVoxels, worldToVoxels_.elements, sizeof(header.worldToVoxels));
+    
+    // Write the root node pointers followed by the nodes
+    return VoxelTreeFile::write(fileName, header, treeData());
+}
+
 void VoxelTree::updateBuild()
 {
-    // Start another tile build if the limit is not currently met
-    int activeTiles = startedTiles_ - mergedTiles_;
-    if(activeTiles < ConcurrentBuilds && startedTiles_ < totalTiles())
+    // Start more tile builds until the limit is met
+    while(startedTiles_ - mergedTiles_ < concurrentBuilds_ && startedTiles_ < totalTiles())
     {
         startTileBuild();
     }
     
-    // Reupload the tree to the gpu if more tiles have finished
+    // Upload the new nodes to the gpu if more tiles have finished
     if(uploadedTiles_ < mergedTiles_)
     {
-        updateBuffers();
+        updateTreeBuffer();
         
         // Output build stats if now finished
         if(uploadedTiles_ == totalTiles())
@@ -124,19 +286,10 @@ void VoxelTree::startTileBuild()
     // Compute the light space bounds of the tile
     Bounds bounds = tileBoundsLightSpace(tileIndex);
     
-    // Get the entry and exit depths for the tile by rendering
-    // a dual shadow map.
-    float* entryDepths;
-    float* exitDepths;
-    computeDualShadowMaps(bounds, &entryDepths, &exitDepths);
-    
-    // Create the builder.
-    VoxelBuilder* builder = new VoxelBuilder(tileIndex, tileResolution_, entryDepths, exitDepths);
-    
-    // Add to the active tiles list
-    activeTilesMutex_.lock();
-    activeTiles_.push_back(builder);
-    activeTilesMutex_.unlock();
+    // Create the builder and queue the build job.
+    // The job renders the tile's entry and exit depths.
+    VoxelBuilder* builder = new VoxelBuilder(tileIndex, tileResolution_, rasterizer_, bounds, &voxelWriter_, depthFormat_, buildMode_);
+    JobSystem::shared()->submit([this, builder]() { buildTile(builder); }, &tileJobs_);
 }
 
 int VoxelTree::getNextTileToStart()
@@ -144,124 +297,119 @@ int VoxelTree::getNextTileToStart()
     // Check there are tiles waiting to be started
     assert(notStartedTiles_.empty() == false);
     
-    // Get the world to light space transformation matrix (without translation)
-    Matrix4x4 worldToLight = scene_->mainLight()->worldToLocal();
-    worldToLight.set(0, 3, 0.0);
-    worldToLight.set(1, 3, 0.0);
-    worldToLight.set(2, 3, 0.0);
-    
-    // Get the camera position in light space
-    Vector4 cameraPosWorld = Vector4(scene_->mainCamera()->position(), 1.0);
-    Vector3 cameraPosLight = (worldToLight * cameraPosWorld).vec3();
-    
-    // Keep track of the best tile
-    float closestDistance = 1000000000000.0;
-    int highestTileIndex = 0;
-    
-    // Check each tile
-    for(unsigned int i = 0; i < notStartedTiles_.size(); ++i)
+    // Key the tiles again if the camera has moved more than a tile
+    // or turned since they were keyed, so tiles in view build first
+    const Camera* camera = scene_->mainCamera();
+    float tileSize = sceneBoundsLightSpace_.size().maxComponent() / tileSubdivisions();
+    float movedDistance = (camera->position() - keyedCameraPosition_).sqrMagnitude();
+    float turnedCosine = Vector3::dot(camera->forward().vec3(), keyedCameraForward_);
+    if(movedDistance > tileSize * tileSize || turnedCosine < 0.9)
     {
-        // Get the tile centre in light space
-        Bounds tileBounds = tileBoundsLightSpace(notStartedTiles_[i]);
-        Vector3 tileCentre = tileBounds.centre();
-        
-        // Get the camera to tile centre sqr distance
-        float distance = (cameraPosLight - tileCentre).sqrMagnitude();
-        
-        // Check if this tile is the new closest one
-        if(distance < closestDistance)
-        {
-            closestDistance = distance;
-            highestTileIndex = i;
-        }
+        keyNotStartedTiles();
     }
     
-    // Remove the tile from the queue + return it
-    int tileIndex = notStartedTiles_[highestTileIndex];
-    std::swap(notStartedTiles_[highestTileIndex], notStartedTiles_.back());
+    // Remove the tile with the lowest key from the queue + return it
+    std::pop_heap(notStartedTiles_.begin(), notStartedTiles_.end(), std::greater<pair<float, int> >());
+    int tileIndex = notStartedTiles_.back().second;
     notStartedTiles_.pop_back();
     return tileIndex;
 }
 
-void VoxelTree::mergeTiles()
+void VoxelTree::keyNotStartedTiles()
 {
-    // Keep looking for tiles to merge until finished
-    while(mergedTiles_ < totalTiles())
+    const Camera* camera = scene_->mainCamera();
+    keyedCameraPosition_ = camera->position();
+    keyedCameraForward_ = camera->forward().vec3();
+    
+    // Get the light to world transformation matrix (without translation)
+    Matrix4x4 lightToWorld = scene_->mainLight()->localToWorld();
+    lightToWorld.set(0, 3, 0.0);
+    lightToWorld.set(1, 3, 0.0);
+    lightToWorld.set(2, 3, 0.0);
+    
+    // Tile centres are moved into camera space, where the
+    // camera is at the origin looking down positive z
+    Matrix4x4 lightToCamera = camera->worldToLocal() * lightToWorld;
+    
+    // Get the slopes of the view frustum sides
+    float halfFov = (camera->fov() / 2.0) * (M_PI / 180.0);
+    float slopeY = tan(halfFov);
+    float slopeX = slopeY * camera->pixelWidth() / camera->pixelHeight();
+    
+    for(pair<float, int> &tile : notStartedTiles_)
     {
-        // Look for a finished builder
-        activeTilesMutex_.lock();
-        VoxelBuilder* builder = findFinishedBuilder();
-        activeTilesMutex_.unlock();
-        
-        if(builder == NULL)
-        {
-            continue;
-        }
+        // Get the tile centre in camera space and
+        // the radius of a sphere covering the tile
+        Bounds tileBounds = tileBoundsLightSpace(tile.second);
+        Vector3 tileCentre = (lightToCamera * Vector4(tileBounds.centre(), 1.0)).vec3();
+        float radius = tileBounds.size().magnitude() / 2.0;
         
-        // Gather the subtree information
-        int tile = builder->tileIndex();
-        uint32_t* subtree = (uint32_t*)builder->tree();
-        VoxelPointer subtreeRoot = builder->rootAddress();
-
-        // Write the tree to the combined tree and store the root node location
-        VoxelPointer ptr = voxelWriter_.writeTree(subtree, subtreeRoot, tileResolution_);
-        voxelWriter_.setRootNodePointer(tile, ptr);
+        // Check if the sphere is in front of the camera and
+        // inside the frustum sides. The far plane is ignored.
+        bool inView = camera->type() != CameraType::Perspective
+            || (tileCentre.z > -radius
+            && fabs(tileCentre.x) - tileCentre.z * slopeX < radius * sqrt(1.0 + slopeX * slopeX)
+            && fabs(tileCentre.y) - tileCentre.z * slopeY < radius * sqrt(1.0 + slopeY * slopeY));
         
-        // The builder is no longer needed
-        delete builder;
-        
-        // Update the merged tiles count
-        mergedTiles_ ++;
+        // Key on the camera to tile centre sqr distance.
+        // Tiles in view are keyed as if half as far away.
+        tile.first = tileCentre.sqrMagnitude() * (inView ? 0.25 : 1.0);
     }
+    
+    std::make_heap(notStartedTiles_.begin(), notStartedTiles_.end(), std::greater<pair<float, int> >());
 }
 
-VoxelBuilder* VoxelTree::findFinishedBuilder()
+void VoxelTree::buildTile(VoxelBuilder* builder)
 {
-    // Look for a builder that has finished
-    for(unsigned int i = 0; i < activeTiles_.size(); ++i)
+    // The nodes are written into the combined tree as they are built.
+    // Nodes shared with other tiles are found while building.
+    builder->build();
+    assert(builder->buildState() == VoxelBuilderState::Done);
+    
+    // Point the tile's root pointer at the finished tile
+    // and update the merged tiles count. Its nodes are all
+    // written, so are below the current size.
+    rootPointersMutex_.lock();
+    voxelWriter_.setRootNodePointer(builder->tileIndex(), builder->rootAddress());
+    finishedTiles_.push_back(make_pair(builder->tileIndex(), voxelWriter_.dataSizeWords()));
+    reusedTiles_ += builder->reusedRoot() ? 1 : 0;
+    bool finished = (++mergedTiles_ == totalTiles());
+    rootPointersMutex_.unlock();
+    
+    // The builder is no longer needed
+    delete builder;
+    
+    // Nothing else is written once every tile is built,
+    // so the index used to find duplicate nodes can be freed
+    if(finished)
     {
-        // Get the builder
-        VoxelBuilder* builder = activeTiles_[i];
-        
-        // Check the state is Done
-        if(builder->buildState() == VoxelBuilderState::Done)
-        {
-            // Remove the builder from the active list
-            std::swap(activeTiles_[i], activeTiles_.back());
-            activeTiles_.pop_back();
-            
-            return builder;
-        }
+        size_t indexSizeMB = voxelWriter_.indexSizeBytes() / (1024 * 1024);
+        voxelWriter_.releaseIndex();
+        printf("Released %zu MB node index \n", indexSizeMB);
+        printf("Reused the root of %d empty or duplicate tiles \n", reusedTiles_);
     }
-    
-    // No builders are finished
-    return NULL;
 }
 
 void VoxelTree::updateBuffers()
 {
     updateUniformBuffer();
-    updateTreeBuffer();
+    reuploadTreeBuffer();
 }
 
 void VoxelTree::updateUniformBuffer()
 {
-    // Cover the scene witht the shadowmap and get the world to shadow matrix
-    shadowMap_.setLightSpaceBounds(sceneBoundsLightSpace_);
-    Matrix4x4 worldToShadow = shadowMap_.worldToShadowMatrix(0);
-    
-    // Scale the world to shadow matrix by the total voxel resolution
-    Vector3 scale;
-    scale.x = treeResolution_;
-    scale.y = treeResolution_;
-    scale.z = tileResolution_; // The trees are only tiled in x and y
-    worldToShadow = Matrix4x4::scale(scale) * worldToShadow;
+    // There is no uniform buffer without a GPU copy of the tree
+    if(headless())
+    {
+        return;
+    }
     
     // Update the uniform buffer
     VoxelsUniformBuffer buffer;
-    buffer.worldToVoxels = worldToShadow;
+    buffer.worldToVoxels = worldToVoxelsMatrix();
     buffer.voxelTreeHeight = log2(tileResolution_);
     buffer.tileSubdivisions = tileSubdivisions();
+    buffer.segmentBits = treeSegmentBits_;
     buffer.pcfSampleCount = pcfKernelSize_ * pcfKernelSize_;
     buffer.pcfLookups = ((pcfKernelSize_ + 7) / 8) * ((pcfKernelSize_ + 7) / 8);
     
@@ -305,6 +453,29 @@ void VoxelTree::updateUniformBuffer()
     uniformManager_->updateVoxelBuffer(&buffer, sizeof(VoxelsUniformBuffer));
 }
 
+Matrix4x4 VoxelTree::computeWorldToVoxelsMatrix() const
+{
+    // Get the world to light space transformation matrix (without translation)
+    Matrix4x4 worldToLight = scene_->mainLight()->worldToLocal();
+    worldToLight.set(0, 3, 0.0);
+    worldToLight.set(1, 3, 0.0);
+    worldToLight.set(2, 3, 0.0);
+    
+    // Map the scene bounds to the [0-1] range.
+    // This matches the orthographic projection used for the tile depths.
+    Vector3 boundsSize = sceneBoundsLightSpace_.size();
+    Matrix4x4 lightToBounds = Matrix4x4::scale(Vector3(1.0 / boundsSize.x, 1.0 / boundsSize.y, 1.0 / boundsSize.z))
+        * Matrix4x4::translation(-1.0 * sceneBoundsLightSpace_.min());
+    
+    // Scale by the total voxel resolution
+    Vector3 scale;
+    scale.x = treeResolution_;
+    scale.y = treeResolution_;
+    scale.z = tileResolution_; // The trees are only tiled in x and y
+    
+    return Matrix4x4::scale(scale) * lightToBounds * worldToLight;
+}
+
 uint64_t VoxelTree::pcfBitmask(int kernelX, int kernelY) const
 {
     uint64_t bitmask = 0;
@@ -327,15 +498,197 @@ uint64_t VoxelTree::pcfBitmask(int kernelX, int kernelY) const
 
 void VoxelTree::updateTreeBuffer()
 {
-    // Update the uploaded tiles count
+    // Headless trees stay on the CPU
+    if(headless())
+    {
+        uploadedTiles_ = mergedTiles_;
+        return;
+    }
+    
+    // Upload the words written since the last update. Build jobs may
+    // still be writing nodes past the complete words, so those are left
+    // for a later update. The upload is limited so that finishing many
+    // tiles at once does not stall a frame.
+    size_t uploadEnd = std::min(voxelWriter_.completeSizeWords(), uploadedWords_ + MaxUploadWords);
+    if(uploadEnd > uploadedWords_)
+    {
+        uploadWords(uploadedWords_, uploadEnd);
+        uploadedWords_ = uploadEnd;
+    }
+    
+    // Point the finished tiles whose nodes are all uploaded at their roots
+    bool rootsChanged = false;
+    lock_guard<mutex> lock(rootPointersMutex_);
+    for(size_t i = 0; i < finishedTiles_.size();)
+    {
+        int tile = finishedTiles_[i].first;
+        size_t tileSizeWords = finishedTiles_[i].second;
+        if(tileSizeWords > uploadedWords_)
+        {
+            i++;
+            continue;
+        }
+        
+        uploadedRootPointers_[tile] = treeData()[tile];
+        rootsChanged = true;
+        
+        finishedTiles_[i] = finishedTiles_.back();
+        finishedTiles_.pop_back();
+        uploadedTiles_ ++;
+    }
+    
+    if(rootsChanged)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffers_[0]);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, uploadedRootPointers_.size() * 4, uploadedRootPointers_.data());
+    }
+}
+
+void VoxelTree::reuploadTreeBuffer()
+{
+    if(headless())
+    {
+        uploadedTiles_ = mergedTiles_;
+        return;
+    }
+    
+    // Every finished tile points at its root
+    lock_guard<mutex> lock(rootPointersMutex_);
+    uploadedRootPointers_.assign(treeData(), treeData() + totalTiles());
+    finishedTiles_.clear();
     uploadedTiles_ = mergedTiles_;
     
-    // Get the current tree data
-    const void* treeData = voxelWriter_.data();
-    size_t treeSizeBytes = voxelWriter_.dataSizeBytes();
+    // Replace the buffers with ones that fit the tree.
+    // A mapped tree file is read straight from the page cache.
+    memset(bufferWords_, 0, sizeof(bufferWords_));
+    uploadedWords_ = 0;
+    reserveBufferWords(treeSizeWords());
+    uploadWords(totalTiles(), treeSizeWords());
+    uploadedWords_ = treeSizeWords();
+}
+
+void VoxelTree::uploadWords(size_t firstWord, size_t lastWord)
+{
+    // The shader cannot read words past the last segment
+    if(lastWord > maxUploadWords())
+    {
+        printf("The tree is too large to upload. The buffer textures hold %zu MB \n", maxUploadWords() * 4 / (1024 * 1024));
+        abort();
+    }
+    
+    reserveBufferWords(lastWord);
     
-    // Create the buffer to hold the tree
-    glBufferData(GL_TEXTURE_BUFFER, treeSizeBytes, treeData, GL_STATIC_DRAW);
+    // Upload the part of the words in each segment
+    size_t segmentWords = (size_t)1 << treeSegmentBits_;
+    while(firstWord < lastWord)
+    {
+        int segment = (int)(firstWord / segmentWords);
+        size_t segmentStart = segment * segmentWords;
+        size_t wordCount = std::min(lastWord, segmentStart + segmentWords) - firstWord;
+        
+        glBindBuffer(GL_TEXTURE_BUFFER, buffers_[segment]);
+        glBufferSubData(GL_TEXTURE_BUFFER, (firstWord - segmentStart) * 4, wordCount * 4, treeData() + firstWord);
+        firstWord += wordCount;
+    }
+}
+
+void VoxelTree::reserveBufferWords(size_t sizeWords)
+{
+    size_t segmentWords = (size_t)1 << treeSegmentBits_;
+    for(int i = 0; i < VoxelsUniformBuffer::MaxTreeSegments && sizeWords > i * segmentWords; ++i)
+    {
+        size_t segmentStart = i * segmentWords;
+        size_t neededWords = std::min(sizeWords - segmentStart, segmentWords);
+        if(neededWords <= bufferWords_[i])
+        {
+            continue;
+        }
+        
+        // Grow the buffer geometrically, so the words
+        // already uploaded are only copied a few times
+        bufferWords_[i] = std::min(std::max(neededWords, bufferWords_[i] * 2), segmentWords);
+        glBindBuffer(GL_TEXTURE_BUFFER, buffers_[i]);
+        glBufferData(GL_TEXTURE_BUFFER, bufferWords_[i] * 4, NULL, GL_DYNAMIC_DRAW);
+        
+        // Upload the words the old buffer held again.
+        // The first segment starts with the root pointers.
+        size_t uploadedEnd = std::min(uploadedWords_, segmentStart + segmentWords);
+        if(i == 0)
+        {
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, uploadedRootPointers_.size() * 4, uploadedRootPointers_.data());
+            segmentStart = uploadedRootPointers_.size();
+        }
+        
+        if(uploadedEnd > segmentStart)
+        {
+            glBufferSubData(GL_TEXTURE_BUFFER, (segmentStart - i * segmentWords) * 4,
+                (uploadedEnd - segmentStart) * 4, treeData() + segmentStart);
+        }
+    }
+}
+
+size_t VoxelTree::maxUploadWords() const
+{
+    return ((size_t)1 << treeSegmentBits_) * VoxelsUniformBuffer::MaxTreeSegments;
+}
+
+void VoxelTree::createTreeBuffer()
+{
+    // Nothing is uploaded yet
+    memset(bufferWords_, 0, sizeof(bufferWords_));
+    uploadedWords_ = 0;
+    
+    if(headless())
+    {
+        memset(buffers_, 0, sizeof(buffers_));
+        memset(bufferTextures_, 0, sizeof(bufferTextures_));
+        treeSegmentBits_ = 0;
+        return;
+    }
+    
+    // Use the largest power of two segments the driver allows.
+    // Nodes never cross a multiple of VoxelSegmentAlignment words.
+    GLint maxTexels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    treeSegmentBits_ = (int)log2(VoxelSegmentAlignment);
+    while(treeSegmentBits_ < 31 && ((int64_t)2 << treeSegmentBits_) <= maxTexels)
+    {
+        treeSegmentBits_ ++;
+    }
+    
+    if(maxTexels < (GLint)VoxelSegmentAlignment)
+    {
+        printf("Buffer textures hold %d words, fewer than a tree segment \n", maxTexels);
+    }
+    
+    glGenBuffers(VoxelsUniformBuffer::MaxTreeSegments, buffers_);
+    glGenTextures(VoxelsUniformBuffer::MaxTreeSegments, bufferTextures_);
+    for(int i = 0; i < VoxelsUniformBuffer::MaxTreeSegments; ++i)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffers_[i]);
+        glBindTexture(GL_TEXTURE_BUFFER, bufferTextures_[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, buffers_[i]);
+    }
+}
+
+const uint32_t* VoxelTree::treeData() const
+{
+    if(treeFile_ != NULL)
+    {
+        return treeFile_->data();
+    }
+    
+    return (const uint32_t*)voxelWriter_.data();
+}
+
+size_t VoxelTree::treeSizeWords() const
+{
+    if(treeFile_ != NULL)
+    {
+        return treeFile_->dataSizeWords();
+    }
+    
+    return voxelWriter_.dataSizeWords();
 }
 
 Bounds VoxelTree::computeSceneBoundsLightSpace() const
@@ -402,26 +755,3 @@ Bounds VoxelTree::tileBoundsLightSpace(int index) const
 
     return Bounds(boundsMin, boundsMax);
 }
-
-void VoxelTree::computeDualShadowMaps(const Bounds &bounds, float** entryDepths, float** exitDepths)
-{
-    // Set the shadow map to cover the correct area
-    shadowMap_.setLightSpaceBounds(bounds);
-    
-    // Render the shadow map with static but not dynamic objects
-    // Do not use depth biasing.
-    shadowMap_.renderCascades(true, false, false);
-    
-    // Store the depths as the shadow entry depths
-    *entryDepths = new float[tileResolution_ * tileResolution_];
-    glReadPixels(0, 0, tileResolution_, tileResolution_, GL_DEPTH_COMPONENT, GL_FLOAT, *entryDepths);
-    
-    // Render the shadow map back faces
-    glCullFace(GL_FRONT);
-    shadowMap_.renderCascades(true, false, false); // Static objects only
-    glCullFace(GL_BACK);
-    
-    // Store the depths as the shadow exit depths
-    *exitDepths = new float[tileResolution_ * tileResolution_];
-    glReadPixels(0, 0, tileResolution_, tileResolution_, GL_DEPTH_COMPONENT, GL_FLOAT, *exitDepths);
-}
@@ -5,7 +5,7 @@
 
 #include <queue>
 #include <vector>
-#include <thread>
+#include <atomic>
 #include <mutex>
 
 #include <QElapsedTimer>
@@ -16,20 +16,35 @@ using namespace std;
 #include "Light.hpp"
 #include "MeshInstance.hpp"
 #include "Bounds.hpp"
-#include "ShadowMap.hpp"
 #include "UniformManager.hpp"
 #include "VoxelBuilder.hpp"
+#include "VoxelCompactor.hpp"
+#include "VoxelRasterizer.hpp"
+#include "VoxelRelayout.hpp"
+#include "VoxelTreeFile.hpp"
+#include "JobSystem.hpp"
 
 class VoxelTree
 {
-    // The maximum tile count. Each tile is up to 16K.
+    // The maximum tile count.
     const static int MaxTileCount = 64*64;
     
-    // The maximum number of tiles that are built simultaneously.
-    const static int ConcurrentBuilds = 6;
+    // The most words uploaded to the GPU in one update while building.
+    // Limits the frame time when many tiles finish at once.
+    const static size_t MaxUploadWords = 4 * 1024 * 1024;
     
 public:
+    // Without a uniform manager the tree is built headless. No OpenGL
+    // resources are created and the tree is not uploaded to the GPU.
     VoxelTree(UniformManager* uniformManager, const Scene* scene, int resolution);
+    ~VoxelTree();
+    
+    // Loads a tree written by saveToFile. The file is memory mapped
+    // and uploaded without any processing. Returns NULL on failure.
+    static VoxelTree* loadFromFile(UniformManager* uniformManager, const Scene* scene, const string &fileName);
+    
+    // True if the tree is not uploaded to the GPU
+    bool headless() const { return uniformManager_ == NULL; }
 
     // The size of the PCF filter kernel.
     // Either 9 or 17.
@@ -54,16 +69,54 @@ public:
     size_t originalSizeBytes() const;
     size_t originalSizeMB() const;
     
-    // The voxels buffer texture id
-    GLuint treeBufferTexture() const { return bufferTexture_; }
+    // The buffer texture id of each segment of the tree.
+    // Each segment holds 2^treeSegmentBits() words.
+    GLuint treeBufferTexture(int segment) const { return bufferTextures_[segment]; }
+    int treeSegmentBits() const { return treeSegmentBits_; }
+    
+    // The transformation from world space to voxel
+    // coordinates in the range [0, resolution].
+    Matrix4x4 worldToVoxelsMatrix() const { return worldToVoxels_; }
     
     // Sets the size of the PCF filter kernel.
     // Must be either 1, 9 or 17.
     void setPCFFilterSize(int kernelSize);
     
+    // Sets the maximum number of tiles that are built simultaneously.
+    // Defaults to one per job system worker. Each tile in progress
+    // holds its depth maps, so lowering this reduces memory use.
+    void setConcurrentBuilds(int concurrentBuilds);
+    
+    // Stores the tile depths as whole voxels while building.
+    // Halves the depth memory of each tile in progress, but the leaf
+    // masks may differ from the float depths by up to one voxel.
+    void setQuantizedDepths(bool quantizedDepths);
+    
+    // Sets how the tiles are built. Both modes build the same nodes.
+    // Defaults to the recursive build.
+    void setBuildMode(VoxelBuildMode buildMode) { buildMode_ = buildMode; }
+    
+    // Backs the tree buffer with huge pages where the OS supports it.
+    // Reduces TLB misses when building large trees.
+    void enableHugePages() { voxelWriter_.enableHugePages(); }
+    
+    // Shrinks the finished tree by replacing leaves with similar leaves
+    // that differ by at most maxLeafError voxels (see VoxelCompactor).
+    // Returns the size saved and the voxels changed.
+    VoxelCompactionStats compactLeaves(int maxLeafError);
+    
+    // Reorders the nodes of the finished tree so that nearby tiles and
+    // the nodes along each path are stored close together (see VoxelRelayout).
+    // Returns the pointer distances before and after.
+    VoxelLayoutStats relayout();
+    
+    // Writes the finished tree to a file.
+    // Returns false if the file could not be written.
+    bool saveToFile(const string &fileName) const;
+    
     // Carrys out the tree construction process using time slicing.
-    // Most of the work is carried out via background threads, but
-    // some work (eg openGL rendering) occurs on the main thread
+    // Tiles are built by jobs on the shared job system.
+    // Uploading the tree to the GPU occurs on the main thread
     // inside this function.
     void updateBuild();
     
@@ -78,51 +131,129 @@ private:
     // The size of the PCF filter kernel
     int pcfKernelSize_;
     
+    // The maximum number of tiles built simultaneously
+    int concurrentBuilds_;
+    
+    // The type used to store the tile depths while building
+    VoxelDepthFormat depthFormat_;
+    
+    // How the tiles are built
+    VoxelBuildMode buildMode_;
+    
     // The building status
     int startedTiles_;
-    int mergedTiles_;
+    atomic<int> mergedTiles_;
     int uploadedTiles_;
     
+    // The tiles that used the root of another tile without being built.
+    // Changed while holding the root pointers mutex.
+    int reusedTiles_;
+    
     // Resolution of the entire tree and an individual tile
     int treeResolution_;
     int tileResolution_;
     
-    // The voxel buffer and containing buffer texture.
-    GLuint buffer_;
-    GLuint bufferTexture_;
+    // The voxel buffers and containing buffer textures.
+    // Drivers limit the size of a buffer texture, so the tree is split
+    // into segments, each uploaded to its own buffer.
+    GLuint buffers_[VoxelsUniformBuffer::MaxTreeSegments];
+    GLuint bufferTextures_[VoxelsUniformBuffer::MaxTreeSegments];
+    int treeSegmentBits_;
+    
+    // The words each segment buffer has space for. The buffers
+    // grow as the tree is built.
+    size_t bufferWords_[VoxelsUniformBuffer::MaxTreeSegments];
+    
+    // The words at the start of the tree that are uploaded
+    size_t uploadedWords_;
+    
+    // The uploaded root pointers. Each tile points at the empty
+    // root node until all of its nodes are uploaded.
+    vector<uint32_t> uploadedRootPointers_;
     
-    // A shadow map with 1 cascade. Used for creating dual shadow maps.
-    ShadowMap shadowMap_;
+    // The finished tiles whose roots are not uploaded yet, with the
+    // tree size when they finished. Their nodes are all before it.
+    vector<pair<int, size_t> > finishedTiles_;
+    
+    // The transformation the tree was built with
+    Matrix4x4 worldToVoxels_;
+    
+    // Renders the dual shadow maps for each tile on the CPU.
+    VoxelRasterizer* rasterizer_;
     
     // The VoxelWriter containing the entire tree.
+    // Every tile builder writes into it directly.
     VoxelWriter voxelWriter_;
     
-    // The tiles that are not started yet and those being built
-    vector<int> notStartedTiles_;
-    vector<VoxelBuilder*> activeTiles_;
-    mutex activeTilesMutex_;
+    // The mapped tree file when the tree was loaded instead of built
+    VoxelTreeFile* treeFile_;
+    
+    // The tiles that are not started yet, kept as a heap with the
+    // lowest key first. Each tile is keyed on its distance from the
+    // camera, and whether it is in view, when the keys were computed.
+    vector<pair<float, int> > notStartedTiles_;
+    
+    // The camera position and view direction the tiles were keyed with
+    Vector3 keyedCameraPosition_;
+    Vector3 keyedCameraForward_;
+    
+    // Counts the build jobs that are yet to finish
+    JobCounter tileJobs_;
+    
+    // Held while the root node pointers and finished tiles are being changed
+    mutex rootPointersMutex_;
+    
+    // Creates a tree using the contents of a mapped tree file
+    VoxelTree(UniformManager* uniformManager, const Scene* scene, VoxelTreeFile* treeFile);
+    
+    // Creates the buffer texture holding the tree
+    void createTreeBuffer();
     
-    // The thread that merges finished tiles into voxelWriter_
-    thread mergingThread_;
+    // The root node pointers followed by the nodes
+    const uint32_t* treeData() const;
+    size_t treeSizeWords() const;
+    
+    // Computes the world to voxels transformation for the current scene
+    Matrix4x4 computeWorldToVoxelsMatrix() const;
     
     // Starts the processing of the next queued tile.
-    // Renders the tile's depth maps and starts a builder thread.
+    // The build job renders the tile's depth maps.
     void startTileBuild();
+    
+    // Removes the tile to build next from the queue. The tiles are
+    // keyed again first if the camera has moved far since they were keyed.
     int getNextTileToStart();
     
-    // Runs on the merging thread.
-    // Merges finished builders into the
-    void mergeTiles();
+    // Computes the key of each tile that is not started yet
+    void keyNotStartedTiles();
     
-    // Looks for a builder that has finished and is ready
-    // to be merged. Removes it from the active tiles vector.
-    VoxelBuilder* findFinishedBuilder();
+    // Runs as a job. Builds the tile into the combined tree,
+    // points its root pointer at it and deletes the builder.
+    void buildTile(VoxelBuilder* builder);
     
-    // Updates the uniform buffer and tree texture buffer
+    // Updates the uniform buffer and uploads the whole tree
     void updateBuffers();
     void updateUniformBuffer();
+    
+    // Uploads the words written since the last update, up to
+    // MaxUploadWords, then points the finished tiles whose nodes
+    // are all uploaded at their roots
     void updateTreeBuffer();
     
+    // Replaces the uploaded tree with the whole current tree
+    void reuploadTreeBuffer();
+    
+    // Uploads a range of words of the tree, growing the buffers to fit.
+    // Fails if the words do not fit in the segments.
+    void uploadWords(size_t firstWord, size_t lastWord);
+    
+    // Grows the segment buffers to hold the first sizeWords words.
+    // The words already uploaded are kept.
+    void reserveBufferWords(size_t sizeWords);
+    
+    // The most words the segments can hold
+    size_t maxUploadWords() const;
+    
     // Computes the bitmask to use on a leaf for the with
     // the specified PCF kernel centre coordinates
     uint64_t pcfBitmask(int kernelX, int kernelY) const;
@@ -131,7 +262,4 @@ private:
     // The bounds includes *static* objects only.
     Bounds computeSceneBoundsLightSpace() const;
     Bounds tileBoundsLightSpace(int index) const;
-    
-    // Renders dual shadow maps for the scene.
-    void computeDualShadowMaps(const Bounds &bounds, float** entryDepths, float** exitDepths);
 };
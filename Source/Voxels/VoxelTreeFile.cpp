@@ -0,0 +1,172 @@
+#include "VoxelTreeFile.hpp"
+
+#include <assert.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Identifies voxel tree files
+const char VoxelTreeFileMagic[8] = { 'V', 'O', 'X', 'T', 'R', 'E', 'E', '\0' };
+
+static_assert(sizeof(VoxelTreeFileHeader) <= VoxelTreeFile::DataAlignment, "The header must fit before the tree data");
+
+VoxelTreeFile::VoxelTreeFile()
+    : mapping_(NULL),
+    mappingSizeBytes_(0)
+{
+
+}
+
+VoxelTreeFile::~VoxelTreeFile()
+{
+    close();
+}
+
+bool VoxelTreeFile::write(const string &fileName, const VoxelTreeFileHeader &header, const uint32_t* data)
+{
+    FILE* file = fopen(fileName.c_str(), "wb");
+    if(file == NULL)
+    {
+        printf("Failed to open tree file %s \n", fileName.c_str());
+        return false;
+    }
+
+    // Complete the header
+    VoxelTreeFileHeader fileHeader = header;
+    memcpy(fileHeader.magic, VoxelTreeFileMagic, sizeof(VoxelTreeFileMagic));
+    fileHeader.version = Version;
+    fileHeader.headerSizeBytes = sizeof(VoxelTreeFileHeader);
+    fileHeader.dataOffsetBytes = DataAlignment;
+
+    // Write the header, padded up to the start of the data
+    vector<char> headerPage(DataAlignment, 0);
+    memcpy(&headerPage[0], &fileHeader, sizeof(VoxelTreeFileHeader));
+    bool success = fwrite(&headerPage[0], 1, headerPage.size(), file) == headerPage.size();
+
+    // Write the root node pointers followed by the nodes
+    if(success)
+    {
+        success = fwrite(data, 4, fileHeader.dataSizeWords, file) == fileHeader.dataSizeWords;
+    }
+
+    if(fclose(file) != 0)
+    {
+        success = false;
+    }
+
+    if(!success)
+    {
+        printf("Failed to write tree file %s \n", fileName.c_str());
+    }
+
+    return success;
+}
+
+bool VoxelTreeFile::open(const string &fileName)
+{
+    close();
+
+    int file = ::open(fileName.c_str(), O_RDONLY);
+    if(file < 0)
+    {
+        printf("Failed to open tree file %s \n", fileName.c_str());
+        return false;
+    }
+
+    // Get the file size
+    struct stat fileStats;
+    if(fstat(file, &fileStats) != 0 || (size_t)fileStats.st_size < sizeof(VoxelTreeFileHeader))
+    {
+        printf("Tree file %s is too small \n", fileName.c_str());
+        ::close(file);
+        return false;
+    }
+
+    // Map the whole file. A shared read only mapping is backed
+    // directly by the page cache and never copied.
+    size_t sizeBytes = (size_t)fileStats.st_size;
+    void* mapping = mmap(NULL, sizeBytes, PROT_READ, MAP_SHARED, file, 0);
+
+    // The mapping remains valid after the file is closed
+    ::close(file);
+
+    if(mapping == MAP_FAILED)
+    {
+        printf("Failed to map tree file %s \n", fileName.c_str());
+        return false;
+    }
+
+    mapping_ = mapping;
+    mappingSizeBytes_ = sizeBytes;
+
+    if(!validateHeader(fileName))
+    {
+        close();
+        return false;
+    }
+
+    // The whole tree is uploaded straight away
+    madvise(mapping_, mappingSizeBytes_, MADV_WILLNEED);
+
+    return true;
+}
+
+const uint32_t* VoxelTreeFile::data() const
+{
+    return (const uint32_t*)((const char*)mapping_ + header()->dataOffsetBytes);
+}
+
+bool VoxelTreeFile::validateHeader(const string &fileName) const
+{
+    const VoxelTreeFileHeader* fileHeader = header();
+
+    if(memcmp(fileHeader->magic, VoxelTreeFileMagic, sizeof(VoxelTreeFileMagic)) != 0)
+    {
+        printf("%s is not a voxel tree file \n", fileName.c_str());
+        return false;
+    }
+
+    if(fileHeader->version != Version || fileHeader->headerSizeBytes != sizeof(VoxelTreeFileHeader))
+    {
+        printf("Tree file %s has version %u. Version %u is required \n", fileName.c_str(), fileHeader->version, Version);
+        return false;
+    }
+
+    // Check the dimensions are consistent
+    uint32_t tileResolution = fileHeader->tileResolution;
+    if(fileHeader->treeHeight > 29 || tileResolution != (1u << fileHeader->treeHeight) || tileResolution < 8
+       || fileHeader->tileSubdivisions == 0
+       || (uint64_t)tileResolution * fileHeader->tileSubdivisions != fileHeader->treeResolution)
+    {
+        printf("Tree file %s has invalid dimensions \n", fileName.c_str());
+        return false;
+    }
+
+    // Check the data is word aligned, covers the root pointers and is inside the file
+    uint64_t tileCount = (uint64_t)fileHeader->tileSubdivisions * fileHeader->tileSubdivisions;
+    if(fileHeader->dataOffsetBytes % 4 != 0 || fileHeader->dataOffsetBytes > mappingSizeBytes_
+       || fileHeader->dataSizeWords < tileCount
+       || fileHeader->dataSizeWords > (mappingSizeBytes_ - fileHeader->dataOffsetBytes) / 4)
+    {
+        printf("Tree file %s is truncated \n", fileName.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void VoxelTreeFile::close()
+{
+    if(mapping_ != NULL)
+    {
+        munmap(mapping_, mappingSizeBytes_);
+    }
+
+    mapping_ = NULL;
+    mappingSizeBytes_ = 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+// The header at the start of a voxel tree file.
+// The tree words follow at dataOffsetBytes, which is page aligned
+// so the mapped words can be handed to OpenGL without copying.
+struct VoxelTreeFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSizeBytes;
+
+    // Tree dimensions
+    uint32_t treeHeight;
+    uint32_t tileSubdivisions;
+    uint32_t treeResolution;
+    uint32_t tileResolution;
+
+    // The location and size of the root pointers and nodes
+    uint64_t dataOffsetBytes;
+    uint64_t dataSizeWords;
+
+    // The world to voxels matrix the tree was built with
+    float worldToVoxels[16];
+};
+
+// A voxel tree stored on disk.
+// Files are memory mapped read only and shared, so several processes
+// loading the same tree use the same page cache copy.
+class VoxelTreeFile
+{
+public:
+    // Increment whenever the header or node layout changes
+    const static uint32_t Version = 4;
+
+    // Alignment of the tree words within the file.
+    // Covers the 4K and 16K page sizes in use.
+    const static size_t DataAlignment = 16384;
+
+    VoxelTreeFile();
+    ~VoxelTreeFile();
+
+    // Writes a tree file. The magic, version and data offset
+    // of the header are filled in. Returns false on failure.
+    static bool write(const string &fileName, const VoxelTreeFileHeader &header, const uint32_t* data);
+
+    // Maps a tree file into memory and checks the header.
+    // Returns false if the file is missing or invalid.
+    bool open(const string &fileName);
+
+    // The mapped file contents
+    const VoxelTreeFileHeader* header() const { return (const VoxelTreeFileHeader*)mapping_; }
+    const uint32_t* data() const;
+    size_t dataSizeWords() const { return header()->dataSizeWords; }
+
+private:
+    void* mapping_;
+    size_t mappingSizeBytes_;
+
+    // Checks the header describes a tree that fits in the file
+    bool validateHeader(const string &fileName) const;
+
+    // Unmaps the file
+    void close();
+};
@@ -2,39 +2,52 @@
 
 #include <assert.h>
 #include <memory.h>
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
 
 VoxelWriter::VoxelWriter()
-    : innerNodeLocations_(),
-    leafLocations_()
+    : arena_(),
+    sizeWords_(0),
+    writtenWords_(0),
+    completeSizeWords_(0),
+    indexReleased_(false)
 {
-    // Define the max buffer size
-    const uint32_t bufferSizeMB = 128;
-    const uint32_t bufferSizeB = bufferSizeMB * 1024 * 1024;
-    maxSizeWords_ = bufferSizeB / 4;
-    
-    // Allocate the buffer
-    data_ = new uint32_t[maxSizeWords_];
-    sizeWords_ = 0;
+    // The buffer can grow to the whole arena. Pointers are 32 bit word
+    // indexes, and the largest value marks empty hash index entries.
+    data_ = (uint32_t*)arena_.data();
+    maxSizeWords_ = (uint32_t)std::min(arena_.reservedBytes() / 4, (size_t)VoxelHashIndex::EmptyLocation);
 }
 
 VoxelWriter::~VoxelWriter()
 {
-    delete[] data_;
+
+}
+
+void VoxelWriter::setMaxSizeWords(size_t maxSizeWords)
+{
+    maxSizeWords_ = (uint32_t)std::min((size_t)maxSizeWords_, maxSizeWords);
 }
 
 void VoxelWriter::reserveRootNodePointerSpace(int pointerCount)
 {
-    // Must be an empty buffer with enough space
+    // Must be an empty buffer
     assert(sizeWords_ == 0);
-    assert(pointerCount < (int)maxSizeWords_);
     
     // Each pointer occupies 1 word.
+    if(!arena_.commit((size_t)pointerCount * 4))
+    {
+        printf("Failed to allocate %d root node pointers \n", pointerCount);
+        abort();
+    }
+    
     sizeWords_ = pointerCount;
+    writtenWords_ = pointerCount;
     
     // Create a dummy 100% unshadowed node for the root nodes
     // to point at until the tiles are properly created
     VoxelInnerNode node;
+    node.paddingBits = 0;
     node.childMask = 21845; // = 0101010101010101 = 8 Unshadowed children
     VoxelPointer nodePtr = writeNode(node, 0, 0);
     
@@ -51,126 +64,268 @@ void VoxelWriter::setRootNodePointer(int index, VoxelPointer value)
     data_[index] = value;
 }
 
+bool VoxelWriter::findTileRoot(uint64_t depthHash, VoxelPointer* root)
+{
+    std::lock_guard<std::mutex> lock(tileRootsMutex_);
+    
+    auto tileRoot = tileRoots_.find(depthHash);
+    if(tileRoot == tileRoots_.end())
+    {
+        return false;
+    }
+    
+    *root = tileRoot->second;
+    return true;
+}
+
+void VoxelWriter::addTileRoot(uint64_t depthHash, VoxelPointer root)
+{
+    assert(!indexReleased_);
+    
+    std::lock_guard<std::mutex> lock(tileRootsMutex_);
+    tileRoots_[depthHash] = root;
+}
+
 VoxelPointer VoxelWriter::writeNode(const VoxelInnerNode &node, int expandedChildCount, VoxelNodeHash hash)
 {
+    assert(!indexReleased_);
+    
+    // Nodes with the same hash are written one at a time
+    HashStripe* stripe = &hashStripes_[hashStripeIndex(hash)];
+    std::lock_guard<std::mutex> lock(stripe->mutex);
+    
     // Check if a node with the same hash has already been written
-    auto cached = innerNodeLocations_.find(hash);
-    if(cached != innerNodeLocations_.end())
+    VoxelPointer cached = stripe->innerNodeLocations.find(hash);
+    if(cached != VoxelHashIndex::EmptyLocation)
     {
-        return cached->second;
+        return cached;
     }
     
     // No existing node. Write a new one and cache.
-    VoxelPointer ptr = writeWords(&node, 1 + expandedChildCount);
-    innerNodeLocations_.insert(std::pair<VoxelNodeHash, VoxelPointer>(hash, ptr));
+    VoxelPointer ptr = writeInnerNode(node, expandedChildCount);
+    stripe->innerNodeLocations.insert(hash, ptr);
     
     // Return the address
     return ptr;
 }
 
+VoxelPointer VoxelWriter::writeCanonicalNode(const VoxelInnerNode &node, int expandedChildCount, bool leafChildren,
+    const VoxelMirrorHashes &hashes, int* mirror)
+{
+    *mirror = canonicalMirror(hashes);
+    if(*mirror == 0)
+    {
+        return writeNode(node, expandedChildCount, hashes.hashes[0]);
+    }
+    
+    // Mirroring keeps the number of expanded children
+    VoxelInnerNode mirrored = mirrorInnerNode(node, leafChildren, *mirror);
+    return writeNode(mirrored, expandedChildCount, hashes.hashes[*mirror]);
+}
+
 VoxelPointer VoxelWriter::writeLeaf(const VoxelLeafNode &leaf)
+{
+    assert(!indexReleased_);
+    
+    // Leaves with the same hash are written one at a time
+    HashStripe* stripe = &hashStripes_[hashStripeIndex(leaf.leafMask)];
+    std::lock_guard<std::mutex> lock(stripe->mutex);
+    
+    return writeLeafLocked(stripe, leaf);
+}
+
+void VoxelWriter::writeLeaves(const VoxelLeafNode* leaves, int leafCount, VoxelPointer* locations)
+{
+    assert(!indexReleased_);
+    assert(leafCount >= 0 && leafCount <= 64);
+    
+    // Find the stripes used by the leaves
+    uint64_t usedStripes = 0;
+    for(int i = 0; i < leafCount; ++i)
+    {
+        usedStripes |= 1ULL << hashStripeIndex(leaves[i].leafMask);
+    }
+    
+    // Lock them in stripe order, so two batches cannot deadlock
+    static_assert(HashStripeCount <= 64, "The used stripes must fit in a 64 bit mask");
+    for(int i = 0; i < HashStripeCount; ++i)
+    {
+        if(usedStripes & (1ULL << i))
+        {
+            hashStripes_[i].mutex.lock();
+        }
+    }
+    
+    // Start loading every index entry before any are needed
+    for(int i = 0; i < leafCount; ++i)
+    {
+        hashStripes_[hashStripeIndex(leaves[i].leafMask)].leafLocations.prefetch(leaves[i].leafMask);
+    }
+    
+    // Write the leaves in order
+    for(int i = 0; i < leafCount; ++i)
+    {
+        locations[i] = writeLeafLocked(&hashStripes_[hashStripeIndex(leaves[i].leafMask)], leaves[i]);
+    }
+    
+    for(int i = 0; i < HashStripeCount; ++i)
+    {
+        if(usedStripes & (1ULL << i))
+        {
+            hashStripes_[i].mutex.unlock();
+        }
+    }
+}
+
+VoxelPointer VoxelWriter::writeLeafLocked(HashStripe* stripe, const VoxelLeafNode &leaf)
 {
     // Get the leaf hash
     // The hash is identical to the 64 bit leafmask.
     VoxelNodeHash hash = leaf.leafMask;
     
     // Check if a leaf with the same has was already written.
-    auto cached = leafLocations_.find(hash);
-    if(cached != leafLocations_.end())
+    VoxelPointer cached = stripe->leafLocations.find(hash);
+    if(cached != VoxelHashIndex::EmptyLocation)
     {
-        return cached->second;
+        return cached;
     }
     
     // No existing leaf. Write a new one and cache.
     VoxelPointer ptr = writeWords(&leaf, 2);
-    leafLocations_.insert(std::pair<VoxelNodeHash, VoxelPointer>(hash, ptr));
+    stripe->leafLocations.insert(hash, ptr);
     
     // Return the location
     return ptr;
 }
 
-VoxelPointer VoxelWriter::writeTree(const uint32_t* tree, VoxelPointer root, int resolution)
+size_t VoxelWriter::completeSizeWords()
 {
-    // Compute the tree height from the resolution
-    int height = log2(resolution) - 1;
-    
-    // Check the height is valid
-    assert(height > 0);
-    assert(height <= 13); // 13 = the height of a 16K tree
+    // The written count includes the padding before each node. It only
+    // matches the size once every claimed word is written. The size is
+    // read second, so words claimed in between keep them apart.
+    uint32_t writtenWords = writtenWords_.load();
+    uint32_t sizeWords = sizeWords_.load();
+    if(writtenWords == sizeWords)
+    {
+        completeSizeWords_ = sizeWords;
+    }
     
-    // Write the tree to the buffer and return the position of its root
-    uint64_t hash;
-    return writeSubtree(tree, root, height, &hash);
+    return completeSizeWords_;
 }
 
-VoxelPointer VoxelWriter::writeSubtree(const uint32_t* tree, uint32_t nodeLocation, int height, uint64_t* hash)
+size_t VoxelWriter::indexSizeBytes()
 {
-    // Check the height is valid
-    assert(height > 0);
-    assert(height <= 13); // 13 = the height of a 16K tree
+    size_t sizeBytes = 0;
+    for(int i = 0; i < HashStripeCount; ++i)
+    {
+        std::lock_guard<std::mutex> lock(hashStripes_[i].mutex);
+        sizeBytes += hashStripes_[i].innerNodeLocations.sizeBytes();
+        sizeBytes += hashStripes_[i].leafLocations.sizeBytes();
+    }
     
-    // The bottom level in the tree consists of leaf nodes
-    if(height == 1)
+    return sizeBytes;
+}
+
+void VoxelWriter::releaseIndex()
+{
+    for(int i = 0; i < HashStripeCount; ++i)
     {
-        // Get the leaf node
-        VoxelLeafNode leafNode = *(const VoxelLeafNode*)(tree + nodeLocation);
-        
-        // The hash is the leaf mask
-        *hash = leafNode.leafMask;
-        
-        // Write to the buffer and return the pointer.
-        return writeLeaf(leafNode);
+        std::lock_guard<std::mutex> lock(hashStripes_[i].mutex);
+        hashStripes_[i].innerNodeLocations.clear();
+        hashStripes_[i].leafLocations.clear();
     }
     
-    // Otherwise, it is an inner node.
-    VoxelInnerNode innerNode = *(const VoxelInnerNode*)(tree + nodeLocation);
+    std::lock_guard<std::mutex> lock(tileRootsMutex_);
+    std::unordered_map<uint64_t, VoxelPointer>().swap(tileRoots_);
     
-    // Keep track of child hashes
-    uint64_t childHashes[8];
+    indexReleased_ = true;
+}
+
+void VoxelWriter::copyFrom(const VoxelWriter &source)
+{
+    copyFrom((const uint32_t*)source.data(), source.dataSizeWords());
+}
+
+void VoxelWriter::copyFrom(const uint32_t* words, size_t sizeWords)
+{
+    // No more nodes can be found in the index
+    assert(indexReleased_);
     
-    // Check the child mask and write child nodes to the buffer
-    int visitedChildren = 0;
-    for(int i = 0; i < 8; ++i)
+    if(sizeWords > maxSizeWords_ || !arena_.commit(sizeWords * 4))
     {
-        // Write the child if it is mixed
-        if(innerNode.isChildExpanded(i))
-        {
-            // Get the location of the child
-            uint32_t childLocation = innerNode.childPositions[visitedChildren];
-            
-            // Write the child subtree
-            innerNode.childPositions[visitedChildren] = writeSubtree(tree, childLocation, height - 1, &childHashes[i]);
-            
-            visitedChildren ++;
-        }
-        else
+        printf("Failed to copy a %zu MB tree \n", sizeWords * 4 / (1024 * 1024));
+        abort();
+    }
+    
+    memcpy(data_, words, sizeWords * 4);
+    sizeWords_ = (uint32_t)sizeWords;
+    writtenWords_ = (uint32_t)sizeWords;
+}
+
+int VoxelWriter::hashStripeIndex(VoxelNodeHash hash)
+{
+    // Leaf hashes are raw leaf masks, so scramble the
+    // hash to spread similar leaves between stripes.
+    static_assert(HashStripeCount == 64, "The stripe index must use log2(HashStripeCount) bits");
+    return (int)((hash * 0x9e3779b97f4a7c15ULL) >> 58);
+}
+
+VoxelPointer VoxelWriter::writeInnerNode(const VoxelInnerNode &node, int expandedChildCount)
+{
+    // The encoding depends on where the node goes. Other threads may
+    // claim the space first, in which case the node is encoded again.
+    uint32_t words[VoxelMaxInnerNodeWords];
+    uint32_t endPos = sizeWords_.load();
+    uint32_t startPos;
+    int wordCount;
+    do
+    {
+        // Nodes that would cross a segment start the next one
+        wordCount = encodeInnerNode(node, expandedChildCount, endPos, words);
+        startPos = alignToSegment(endPos, wordCount);
+        if(startPos != endPos)
         {
-            // The child is not expanded.
-            // For hashing, use the child mask instead.
-            childHashes[i] = innerNode.childMask;
+            wordCount = encodeInnerNode(node, expandedChildCount, startPos, words);
         }
     }
+    while(!sizeWords_.compare_exchange_weak(endPos, startPos + wordCount));
     
-    // Compute the node hash
-    *hash = computeInnerNodeHash(childHashes);
-    
-    // Write the node and return its address
-    return writeNode(innerNode, visitedChildren, *hash);
+    storeWords(startPos, words, wordCount);
+    writtenWords_ += startPos + wordCount - endPos;
+    return startPos;
 }
 
 VoxelPointer VoxelWriter::writeWords(const void* words, int wordCount)
 {
-    // Check the word count is valid and not too big
+    // Check the word count is valid
     assert(wordCount > 0);
-    assert(sizeWords_ + wordCount <= maxSizeWords_);
     
-    // Remember the start position
-    uint32_t startPos = sizeWords_;
-    
-    // Write to the buffer
-    memcpy(data_ + sizeWords_, words, wordCount * 4);
-    sizeWords_ += wordCount;
+    // Claim the space. Other threads may be writing at the same time.
+    // Nodes that would cross a segment start the next one.
+    uint32_t endPos = sizeWords_.load();
+    uint32_t startPos;
+    do
+    {
+        startPos = alignToSegment(endPos, wordCount);
+    }
+    while(!sizeWords_.compare_exchange_weak(endPos, startPos + wordCount));
+    storeWords(startPos, words, wordCount);
+    writtenWords_ += startPos + wordCount - endPos;
     
     // Return the location
     return startPos;
 }
+
+void VoxelWriter::storeWords(VoxelPointer startPos, const void* words, int wordCount)
+{
+    // Make sure the memory is committed
+    size_t endPos = (size_t)startPos + wordCount;
+    if(endPos > maxSizeWords_ || !arena_.commit(endPos * 4))
+    {
+        printf("The voxel tree is too large. Failed to grow the buffer past %zu MB \n", endPos * 4 / (1024 * 1024));
+        abort();
+    }
+    
+    // Write to the buffer
+    memcpy(data_ + startPos, words, wordCount * 4);
+}
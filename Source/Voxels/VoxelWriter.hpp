@@ -1,26 +1,48 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
+#include <mutex>
 #include <unordered_map>
 
 #include "VoxelNode.hpp"
+#include "VoxelHashIndex.hpp"
+#include "VoxelArena.hpp"
 
 // Writes tree nodes into a buffer.
 // Prevents duplicate nodes from being stored more than once.
+// Nodes can be written from multiple threads at once.
 class VoxelWriter
 {
+    // The number of independently locked parts of the node hash table
+    const static int HashStripeCount = 64;
+    
 public:
     VoxelWriter();
     ~VoxelWriter();
     
-    // The serialized tree data
+    // The serialized tree data.
+    // The buffer grows in place, so the pointer never changes.
     const void* data() const { return data_; }
     
     // The size of the written data
     size_t dataSizeBytes() const { return sizeWords_ * 4; }
     size_t dataSizeWords() const { return sizeWords_; }
     
+    // The number of words at the start of the buffer that are fully
+    // written. Nodes are written after their space is claimed, so while
+    // other threads are writing this returns the last size at which no
+    // writes were in progress. Call from one thread at a time.
+    size_t completeSizeWords();
+    
+    // Backs the buffer with huge pages where possible
+    void enableHugePages() { arena_.enableHugePages(); }
+    
+    // Limits the buffer to the words a reader can address.
+    // Growing the buffer past it fails.
+    void setMaxSizeWords(size_t maxSizeWords);
+    
     // Reserves space for the specified number of root node
     // pointers at the start of the buffer.
     void reserveRootNodePointerSpace(int pointerCount);
@@ -28,34 +50,95 @@ public:
     // Sets a root node pointer to the specified index.
     void setRootNodePointer(int index, VoxelPointer value);
     
-    // Writes an inner node to the buffer.
-    // Returns its position pointer.
+    // Tiles with the same depths have the same nodes. Finds the root of
+    // a finished tile with the specified depth hash, or records the root
+    // of a tile once it is finished. Safe to call from any thread.
+    bool findTileRoot(uint64_t depthHash, VoxelPointer* root);
+    void addTileRoot(uint64_t depthHash, VoxelPointer root);
+    
+    // Writes an inner node to the buffer. Child pointers that are close
+    // enough are stored as 16 bit offsets (see encodeInnerNode).
+    // Returns its position pointer. If another thread is writing a node
+    // with the same hash, both calls return the same pointer.
     VoxelPointer writeNode(const VoxelInnerNode &node, int expandedChildCount, VoxelNodeHash hash);
     
+    // Writes the mirror image of an inner node with the smallest hash, so
+    // mirrored copies of a node are stored once. Outputs the mirror that
+    // gives back the node from the stored one. leafChildren is true for
+    // 8x8x8 nodes (see computeMirrorHashes).
+    VoxelPointer writeCanonicalNode(const VoxelInnerNode &node, int expandedChildCount, bool leafChildren,
+        const VoxelMirrorHashes &hashes, int* mirror);
+    
     // Writes a leaf node to the buffer.
     // Returns its position pointer.
     VoxelPointer writeLeaf(const VoxelLeafNode &leaf);
     
-    // Writes an entire subtree to the buffer.
-    // Returns a pointer to the root node.
-    VoxelPointer writeTree(const uint32_t* tree, VoxelPointer root, int resolution);
+    // Writes several leaf nodes, in order, and outputs their positions.
+    // The index lookups for the leaves are started together, so their
+    // cache misses overlap. At most 64 leaves can be written at once.
+    void writeLeaves(const VoxelLeafNode* leaves, int leafCount, VoxelPointer* locations);
+    
+    // The memory used to find duplicate nodes
+    size_t indexSizeBytes();
+    
+    // Frees the memory used to find duplicate nodes.
+    // No more nodes can be written afterwards.
+    void releaseIndex();
+    
+    // Replaces the buffer with a copy of another writer's buffer, or of
+    // a buffer of words. Used to swap in a rewritten tree once the index
+    // is released.
+    void copyFrom(const VoxelWriter &source);
+    void copyFrom(const uint32_t* words, size_t sizeWords);
     
 private:
+    // Part of the node hash table.
+    // Nodes are written while holding the stripe of their hash.
+    struct HashStripe
+    {
+        std::mutex mutex;
+        
+        // Cache of leaf and inner node locations, stored based on hash
+        VoxelHashIndex innerNodeLocations;
+        VoxelHashIndex leafLocations;
+    };
+    
+    // Holds the buffer. Memory is committed as the buffer grows.
+    VoxelArena arena_;
+    
     uint32_t* data_;
-    uint32_t sizeWords_;
+    std::atomic<uint32_t> sizeWords_;
+    
+    // The words that have been written, and the last size
+    // with every word written (see completeSizeWords)
+    std::atomic<uint32_t> writtenWords_;
+    size_t completeSizeWords_;
     uint32_t maxSizeWords_;
     
-    // Cache of leaf and inner node locations, stored based on hash
-    std::unordered_map<VoxelNodeHash, VoxelPointer> innerNodeLocations_;
-    std::unordered_map<VoxelNodeHash, VoxelPointer> leafLocations_;
+    HashStripe hashStripes_[HashStripeCount];
+    
+    // The roots of the finished tiles by the hash of their depths
+    std::mutex tileRootsMutex_;
+    std::unordered_map<uint64_t, VoxelPointer> tileRoots_;
     
-    // Writes an entire subtree to the buffer, merging with any
-    // existing duplicate nodes that are already in the buffer.
-    // Returns the subtree node location.
-    // Also outputs the hash of the subtree.
-    VoxelPointer writeSubtree(const uint32_t* tree, uint32_t nodeLocation, int height, uint64_t* hash);
+    // True once the index is released
+    bool indexReleased_;
+    
+    // Gets the stripe containing a hash
+    static int hashStripeIndex(VoxelNodeHash hash);
+    
+    // Writes a leaf. The stripe of its hash must be locked.
+    VoxelPointer writeLeafLocked(HashStripe* stripe, const VoxelLeafNode &leaf);
+    
+    // Encodes an inner node at the end of the buffer (see encodeInnerNode).
+    // Returns its location.
+    VoxelPointer writeInnerNode(const VoxelInnerNode &node, int expandedChildCount);
     
     // Writes data to the buffer.
+    // Space is allocated atomically, so any thread can write.
     // Returns the word index of the first written word.
     VoxelPointer writeWords(const void* words, int wordCount);
+    
+    // Copies words into space that has been claimed
+    void storeWords(VoxelPointer startPos, const void* words, int wordCount);
 };
@@ -1,47 +1,24 @@
 #include <QApplication>
 
 #include <string>
+#include <cstdlib>
+#include <algorithm>
 
+#include "CommandLine.hpp"
+#include "JobSystem.hpp"
 #include "MainWindow.hpp"
 #include "MainWindowController.hpp"
 
-bool flagSet(std::string flag, int argc, char* argv[])
-{
-    for(int i = 0; i < argc; ++i)
-    {
-        // Check if the flag exists
-        std::string actualValue(argv[i]);
-        if(actualValue == flag)
-        {
-            return true;
-        }
-    }
-    
-    // No flag set.
-    return false;
-}
-
-int getTreeResolution(int argc, char* argv[])
-{
-    // Look for a resolution flag
-    if(flagSet("2k", argc, argv)) return 2048;
-    if(flagSet("4k", argc, argv)) return 4096;
-    if(flagSet("8k", argc, argv)) return 8192;
-    if(flagSet("16k", argc, argv)) return 16384;
-    if(flagSet("32k", argc, argv)) return 32768;
-    if(flagSet("64k", argc, argv)) return 65536;
-    if(flagSet("128k", argc, argv)) return 131072;
-    if(flagSet("256k", argc, argv)) return 262144;
-    if(flagSet("512k", argc, argv)) return 524288;
-    
-    // No flag set, use 32K as the default
-    return 32768;
-}
-
 int main(int argc, char* argv[])
 {
     QApplication app(argc, argv);
     
+    // The number of background threads used to build the voxel tree
+    if(flagSet("-workers", argc, argv))
+    {
+        JobSystem::setSharedWorkerCount(std::max(1, atoi(flagValue("-workers", "1", argc, argv).c_str())));
+    }
+    
     // Specify OpenGL 4.0 Core Profile
     QGLFormat format = QGLFormat::defaultFormat();
     format.setVersion(4, 0);
@@ -49,7 +26,9 @@ int main(int argc, char* argv[])
     
     // Create the window and controller
     bool fullScreen = flagSet("-fullscreen", argc, argv);
-    MainWindow* window = new MainWindow(fullScreen, format, getTreeResolution(argc, argv));
+    // A prebuilt tree from voxelbake can be loaded with -tree
+    std::string treeFile = flagValue("-tree", "", argc, argv);
+    MainWindow* window = new MainWindow(fullScreen, format, getTreeResolution(argc, argv), treeFile);
     MainWindowController* controller = new MainWindowController(window);
 
     // Pass all events to the controller
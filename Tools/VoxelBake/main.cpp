@@ -0,0 +1,279 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <chrono>
+
+#include <sys/resource.h>
+
+#if defined(__linux__)
+    #include <cstring>
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+#include <QElapsedTimer>
+
+#include "CommandLine.hpp"
+#include "JobSystem.hpp"
+#include "Scene.hpp"
+#include "VoxelLeafMask.hpp"
+#include "VoxelTree.hpp"
+
+// Builds a voxel tree for a scene without opening a window.
+//
+// Usage: voxelbake [resolution] [-scene file.scene] [-workers count] [-tiles count] [-hugepages] [-quantize] [-levels] [-lossy bits] [-relayout] [-counters] [-o output]
+// eg ./voxelbake 128k -scene scene.scene -workers 12 -o scene-128k.voxels
+//
+// -workers sets the number of job system threads (default: one per hardware thread).
+// -tiles sets the number of tiles built at once (default: one per worker).
+// -hugepages backs the tree with huge pages where the OS supports them.
+// -quantize stores the tile depths as whole voxels. Uses less memory, but is
+//  accurate to one voxel.
+// -levels builds each tile a level at a time, from the leaves up, instead of recursively.
+// -lossy merges leaves that differ by at most this many voxels (1 - 15) once the tree is built.
+// -relayout reorders the finished tree so nodes used together are stored together.
+// -counters reports the CPU cache misses of the build, where the OS allows it.
+
+size_t peakMemoryUsageBytes()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+#if defined(__APPLE__)
+    // Reported in bytes on mac
+    return (size_t)usage.ru_maxrss;
+#else
+    // Reported in kilobytes on linux
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+// Hardware cache event counters for the build.
+// The job system workers inherit them, so they must be
+// opened before the workers start.
+struct CacheCounters
+{
+    int l1DataReadMisses;
+    int references;
+    int misses;
+};
+
+int openCacheCounter(uint32_t type, uint64_t config)
+{
+#if defined(__linux__)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+CacheCounters openCacheCounters()
+{
+    CacheCounters counters;
+#if defined(__linux__)
+    counters.l1DataReadMisses = openCacheCounter(PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    counters.references = openCacheCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+    counters.misses = openCacheCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+    counters.l1DataReadMisses = -1;
+    counters.references = -1;
+    counters.misses = -1;
+#endif
+    return counters;
+}
+
+// Returns false if the counter could not be opened or read
+bool readCacheCounter(int counter, uint64_t* value)
+{
+#if defined(__linux__)
+    return counter >= 0 && read(counter, value, sizeof(*value)) == sizeof(*value);
+#else
+    return false;
+#endif
+}
+
+void printCacheCounters(const CacheCounters &counters)
+{
+    uint64_t l1DataReadMisses, references, misses;
+    if(readCacheCounter(counters.l1DataReadMisses, &l1DataReadMisses))
+    {
+        printf("L1 data cache read misses: %llu \n", (unsigned long long)l1DataReadMisses);
+    }
+
+    if(readCacheCounter(counters.references, &references) && readCacheCounter(counters.misses, &misses))
+    {
+        double missRate = (references > 0) ? 100.0 * misses / references : 0.0;
+        printf("Cache misses: %llu (%.1f%% of %llu references) \n",
+            (unsigned long long)misses, missRate, (unsigned long long)references);
+    }
+    else
+    {
+        printf("Cache counters are not available \n");
+    }
+}
+
+void closeCacheCounter(int counter)
+{
+#if defined(__linux__)
+    if(counter >= 0)
+    {
+        close(counter);
+    }
+#endif
+}
+
+void closeCacheCounters(const CacheCounters &counters)
+{
+    closeCacheCounter(counters.l1DataReadMisses);
+    closeCacheCounter(counters.references);
+    closeCacheCounter(counters.misses);
+}
+
+int main(int argc, char* argv[])
+{
+    // Read the settings
+    int resolution = getTreeResolution(argc, argv);
+    std::string sceneFile = flagValue("-scene", "scene.scene", argc, argv);
+    std::string outputFile = flagValue("-o", "tree.voxels", argc, argv);
+    int workers = atoi(flagValue("-workers", std::to_string(JobSystem::defaultWorkerCount()), argc, argv).c_str());
+    int concurrentTiles = atoi(flagValue("-tiles", std::to_string(workers), argc, argv).c_str());
+
+    int maxLeafError = atoi(flagValue("-lossy", "0", argc, argv).c_str());
+
+    if(workers <= 0 || concurrentTiles <= 0)
+    {
+        printf("The worker and tile counts must be positive \n");
+        return 1;
+    }
+
+    if(maxLeafError < 0 || maxLeafError > 15)
+    {
+        printf("The lossy leaf error must be between 0 and 15 voxels \n");
+        return 1;
+    }
+
+    JobSystem::setSharedWorkerCount(workers);
+
+    // Load the scene geometry. No OpenGL context is needed.
+    Scene scene(true);
+    if(!scene.loadFromFile(sceneFile))
+    {
+        return 1;
+    }
+
+    // Count from the start of the build
+    bool countCacheMisses = flagSet("-counters", argc, argv);
+    CacheCounters cacheCounters;
+    if(countCacheMisses)
+    {
+        cacheCounters = openCacheCounters();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Build the tree headless
+    VoxelTree tree(NULL, &scene, resolution);
+    tree.setConcurrentBuilds(concurrentTiles);
+
+    if(flagSet("-hugepages", argc, argv))
+    {
+        tree.enableHugePages();
+    }
+
+    bool quantize = flagSet("-quantize", argc, argv);
+    tree.setQuantizedDepths(quantize);
+
+    bool levels = flagSet("-levels", argc, argv);
+    tree.setBuildMode(levels ? VoxelBuildMode::Levels : VoxelBuildMode::Recursive);
+
+    printf("Building %dK tree with %d tiles using %d workers \n", resolution / 1024, tree.totalTiles(), workers);
+    printf("Leaf masks are sampled with the %s kernel \n", voxelLeafMaskKernelName());
+
+    if(quantize)
+    {
+        printf("Tile depths are stored as whole voxels \n");
+    }
+
+    if(levels)
+    {
+        printf("Tiles are built a level at a time \n");
+    }
+
+    while(tree.completedTiles() < tree.totalTiles())
+    {
+        tree.updateBuild();
+
+        // The work happens on the job system workers
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    qint64 buildTime = timer.elapsed();
+
+    // Stop counting before the passes that change the finished tree
+    if(countCacheMisses)
+    {
+        printCacheCounters(cacheCounters);
+        closeCacheCounters(cacheCounters);
+    }
+
+    // Trade accuracy for size
+    if(maxLeafError > 0)
+    {
+        QElapsedTimer compactTimer;
+        compactTimer.start();
+        VoxelCompactionStats stats = tree.compactLeaves(maxLeafError);
+
+        double sizeRatio = (double)stats.sizeWordsBefore / (double)stats.sizeWordsAfter;
+        double errorPercent = 100.0 * (double)stats.errorVoxels / (double)std::max(stats.leafVoxels, (uint64_t)1);
+        printf("Merged %zu of %zu leaves differing by up to %d voxels in %lld ms \n",
+            stats.mergedLeafCount, stats.leafCount, maxLeafError, compactTimer.elapsed());
+        printf("Lossy compaction: %zu KB -> %zu KB (%.2f : 1), %llu voxels changed (%.4f%% of leaf voxels) \n",
+            stats.sizeWordsBefore * 4 / 1024, stats.sizeWordsAfter * 4 / 1024, sizeRatio,
+            (unsigned long long)stats.errorVoxels, errorPercent);
+    }
+
+    // Store the nodes in the order they are used
+    if(flagSet("-relayout", argc, argv))
+    {
+        QElapsedTimer relayoutTimer;
+        relayoutTimer.start();
+        VoxelLayoutStats stats = tree.relayout();
+
+        printf("Reordered tree in %lld ms: %zu KB -> %zu KB \n", relayoutTimer.elapsed(),
+            stats.sizeWordsBefore * 4 / 1024, stats.sizeWordsAfter * 4 / 1024);
+        printf("Average child pointer distance in words by depth: \n");
+        for(size_t depth = 0; depth < stats.pointerDistanceBefore.size(); ++depth)
+        {
+            printf("  %zu: %.0f -> %.0f \n", depth, stats.pointerDistanceBefore[depth], stats.pointerDistanceAfter[depth]);
+        }
+    }
+
+    // Write the finished tree
+    if(!tree.saveToFile(outputFile))
+    {
+        return 1;
+    }
+
+    // Output build stats
+    double compressionRatio = (double)tree.originalSizeBytes() / (double)tree.sizeBytes();
+    printf("Build time: %lld ms \n", buildTime);
+    printf("Tree size: %zu MB (original %zu MB) \n", tree.sizeMB(), tree.originalSizeMB());
+    printf("Compression ratio: %.1f : 1 \n", compressionRatio);
+    printf("Peak RSS: %zu MB \n", peakMemoryUsageBytes() / (1024 * 1024));
+    printf("Wrote tree to %s \n", outputFile.c_str());
+
+    return 0;
+}
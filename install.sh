@@ -1,3 +1,4 @@
+# Build the application
 qmake -project \
     CONFIG+=c++11 \
     CONFIG-=app_bundle \
@@ -9,7 +10,44 @@ qmake -project \
     "INCLUDEPATH += . Source/Math" \
     "INCLUDEPATH += . Source/Assets" \
     "INCLUDEPATH += . Source/Voxels" \
-    "INCLUDEPATH += . Source/Scene"
+    "INCLUDEPATH += . Source/Scene" \
+    "INCLUDEPATH += . Source/Threading" \
+    Source
 
 qmake
 make
+make clean
+rm -f *.pro
+rm -f Makefile
+
+# Build the voxelbake command line tool.
+# It builds voxel trees without a window, so only the scene
+# loading and voxel sources are needed.
+qmake -project -o voxelbake.pro \
+    CONFIG+=c++11 \
+    CONFIG+=console \
+    CONFIG-=app_bundle \
+    QT+=opengl \
+    QT+=gui \
+    "TARGET = voxelbake" \
+    "INCLUDEPATH += . Source/" \
+    "INCLUDEPATH += . Source/Rendering" \
+    "INCLUDEPATH += . Source/Math" \
+    "INCLUDEPATH += . Source/Assets" \
+    "INCLUDEPATH += . Source/Voxels" \
+    "INCLUDEPATH += . Source/Scene" \
+    "INCLUDEPATH += . Source/Threading" \
+    Source/CommandLine.cpp \
+    Source/Math \
+    Source/Assets \
+    Source/Scene \
+    Source/Voxels \
+    Source/Threading \
+    Source/Rendering/UniformManager.cpp \
+    Tools/VoxelBake
+
+qmake voxelbake.pro
+make
+make clean
+rm -f *.pro
+rm -f Makefile
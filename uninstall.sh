@@ -1,4 +1,4 @@
-make clean
 rm -f *.pro
 rm -f Makefile
 rm -f voxelized-shadows
+rm -f voxelbake